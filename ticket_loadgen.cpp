@@ -0,0 +1,717 @@
+// Open-loop load generator for the ticket server.
+// Build and run against a server on loopback:
+//   g++ -std=c++17 -O2 -pthread -o ticket_loadgen ticket_loadgen.cpp
+//   ./ticket_server -f events_example &
+//   ./ticket_loadgen -r 20000 -d 10 -t 2 -m 1:8:1
+// Requests are sent at their scheduled times whether or not earlier ones
+// were answered, and latency is measured from the scheduled time, so a
+// stalled server is not hidden by a stalled client (coordinated omission).
+// Requests that get no reply, or are never sent because every socket still
+// waits for one, count in the percentiles with at least the reply timeout.
+// The generator spins between sends at high rates, so it is best run on
+// other cores than the server. Every message type prints one JSON line.
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <netinet/in.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "ticket_protocol.h"
+
+using std::string;
+
+#define DEFAULT_ADDRESS "127.0.0.1"
+#define DEFAULT_PORT 2022
+#define DEFAULT_RATE 10000
+#define DEFAULT_DURATION 10
+#define DEFAULT_THREADS 1
+#define DEFAULT_IN_FLIGHT 64
+#define DEFAULT_TICKETS 1
+#define MAX_THREADS 64
+#define MAX_IN_FLIGHT 4096
+#define MAX_DURATION 3600
+#define MAX_RATE 10000000
+
+// A request without a reply after this long is counted as lost
+#define REPLY_TIMEOUT_NS 1000000000ULL
+#define EXPIRY_SCAN_NS 10000000ULL
+#define NS_PER_SECOND 1000000000ULL
+// Reservations kept by each thread for its GET_TICKETS
+#define RESERVATIONS_KEPT 4096
+
+// Histogram buckets: exact below 2^HISTOGRAM_SUB_BITS, then
+// 2^(HISTOGRAM_SUB_BITS - 1) buckets per power of two, about 1.6% wide
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF_COUNT (HISTOGRAM_SUB_COUNT / 2)
+#define HISTOGRAM_BUCKETS                                                      \
+  (HISTOGRAM_SUB_COUNT + (64 - HISTOGRAM_SUB_BITS) * HISTOGRAM_HALF_COUNT)
+
+#define PRINT_ERRNO()                                                          \
+  do {                                                                         \
+    if (errno != 0) {                                                          \
+      fprintf(stderr, "Error: errno %d in %s at %s:%d\n%s\n", errno, __func__, \
+              __FILE__, __LINE__, strerror(errno));                            \
+      exit(EXIT_FAILURE);                                                      \
+    }                                                                          \
+  } while (0)
+
+// Set `errno` to 0 and evaluate `x`. If `errno` changed, describe it and exit.
+#define CHECK_ERRNO(x)                                                         \
+  do {                                                                         \
+    errno = 0;                                                                 \
+    (void)(x);                                                                 \
+    PRINT_ERRNO();                                                             \
+  } while (0)
+
+#define ENSURE(x)                                                              \
+  do {                                                                         \
+    bool result = (x);                                                         \
+    if (!result) {                                                             \
+      fprintf(stderr, "Error: %s was false in %s at %s:%d\n", #x, __func__,    \
+              __FILE__, __LINE__);                                             \
+      exit(EXIT_FAILURE);                                                      \
+    }                                                                          \
+  } while (0)
+
+enum REQUEST_TYPE {
+  EVENTS_REQUEST = 0,
+  RESERVATION_REQUEST = 1,
+  TICKETS_REQUEST = 2,
+  REQUEST_TYPES = 3,
+};
+
+static const char *request_names[REQUEST_TYPES] = {
+    "GET_EVENTS", "GET_RESERVATION", "GET_TICKETS"};
+
+static uint64_t now_ns() {
+  struct timespec now {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * NS_PER_SECOND + (uint64_t)now.tv_nsec;
+}
+
+// Log-linear histogram of latencies in nanoseconds, in the manner of
+// HdrHistogram: recording is an index computation and an increment.
+class LatencyHistogram {
+public:
+  LatencyHistogram() : counts(HISTOGRAM_BUCKETS, 0) {}
+
+  void record(uint64_t value) {
+    counts[bucket_of(value)]++;
+    total++;
+    sum += value;
+    maximum = std::max(maximum, value);
+  }
+
+  void merge(const LatencyHistogram &other) {
+    for (size_t i = 0; i < counts.size(); i++) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    maximum = std::max(maximum, other.maximum);
+  }
+
+  // The upper bound of the bucket holding the given percentile
+  [[nodiscard]] uint64_t percentile(double percent) const {
+    if (total == 0) {
+      return 0;
+    }
+    auto rank = (uint64_t)std::ceil(percent / 100.0 * (double)total);
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return std::min(highest_in(i), maximum);
+      }
+    }
+    return maximum;
+  }
+
+  [[nodiscard]] uint64_t get_count() const { return total; }
+
+  [[nodiscard]] uint64_t get_max() const { return maximum; }
+
+  [[nodiscard]] double get_mean() const {
+    return total == 0 ? 0.0 : (double)sum / (double)total;
+  }
+
+private:
+  static size_t bucket_of(uint64_t value) {
+    if (value < HISTOGRAM_SUB_COUNT) {
+      return value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    int shift = magnitude - (HISTOGRAM_SUB_BITS - 1);
+    return HISTOGRAM_SUB_COUNT +
+           (size_t)(magnitude - HISTOGRAM_SUB_BITS) * HISTOGRAM_HALF_COUNT +
+           (size_t)((value >> shift) - HISTOGRAM_HALF_COUNT);
+  }
+
+  static uint64_t highest_in(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_COUNT) {
+      return bucket;
+    }
+    size_t above = bucket - HISTOGRAM_SUB_COUNT;
+    int magnitude = (int)(above / HISTOGRAM_HALF_COUNT) + HISTOGRAM_SUB_BITS;
+    int shift = magnitude - (HISTOGRAM_SUB_BITS - 1);
+    uint64_t top = above % HISTOGRAM_HALF_COUNT + HISTOGRAM_HALF_COUNT;
+    return ((top + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> counts;
+  uint64_t total{0};
+  uint64_t sum{0};
+  uint64_t maximum{0};
+};
+
+struct type_statistics {
+  // Latency from the scheduled send time, corrected for coordinated omission
+  LatencyHistogram latency;
+  // Latency from the actual send time, as a closed-loop client would see it
+  LatencyHistogram service_time;
+  uint64_t sent{0};
+  uint64_t replied{0};
+  uint64_t bad_requests{0};
+  uint64_t lost{0};
+  // Scheduled but never sent, so not counted in `sent`
+  uint64_t unsent{0};
+
+  // Lost and unsent requests are recorded as if answered after
+  // `waited`, which is at least the reply timeout
+  void record_failure(uint64_t waited, uint64_t waited_since_sent) {
+    latency.record(std::max<uint64_t>(waited, REPLY_TIMEOUT_NS));
+    service_time.record(
+        std::max<uint64_t>(waited_since_sent, REPLY_TIMEOUT_NS));
+  }
+
+  void merge(const type_statistics &other) {
+    latency.merge(other.latency);
+    service_time.merge(other.service_time);
+    sent += other.sent;
+    replied += other.replied;
+    bad_requests += other.bad_requests;
+    lost += other.lost;
+    unsent += other.unsent;
+  }
+};
+
+class LoadParameters {
+private:
+  enum WRONG_PARAMETERS {
+    WRONG_FLAGS = 1,
+    WRONG_ADDRESS = 2,
+    WRONG_PORT = 3,
+    WRONG_RATE = 4,
+    WRONG_DURATION = 5,
+    WRONG_THREADS = 6,
+    WRONG_MIX = 7,
+    WRONG_IN_FLIGHT = 8,
+    WRONG_TICKETS = 9,
+  };
+
+public:
+  LoadParameters(int argc, char *argv[]) : bin_file(argv[0]) {
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(DEFAULT_PORT);
+    inet_pton(AF_INET, DEFAULT_ADDRESS, &server_address.sin_addr);
+    check_parameters(argc, argv);
+  }
+
+private:
+  void exit_program(int status) {
+    string message;
+    switch (status) {
+    case WRONG_ADDRESS:
+      message = "WRONG SERVER ADDRESS PARAMETER (EXPECTED IPv4)";
+      break;
+    case WRONG_PORT:
+      message = "WRONG PORT NUMBER PARAMETER";
+      break;
+    case WRONG_RATE:
+      message = "WRONG RATE PARAMETER";
+      break;
+    case WRONG_DURATION:
+      message = "WRONG DURATION PARAMETER";
+      break;
+    case WRONG_THREADS:
+      message = "WRONG THREADS NUMBER PARAMETER";
+      break;
+    case WRONG_MIX:
+      message = "WRONG MIX PARAMETER (EXPECTED <events>:<reservations>:"
+                "<tickets>)";
+      break;
+    case WRONG_IN_FLIGHT:
+      message = "WRONG IN FLIGHT REQUESTS PARAMETER";
+      break;
+    case WRONG_TICKETS:
+      message = "WRONG TICKETS PER RESERVATION PARAMETER";
+      break;
+    default:
+      message = "WRONG LOAD GENERATOR FLAGS";
+    }
+    fprintf(stderr,
+            "Usage: %s [-a <server address>] [-p <port>] [-r <requests per "
+            "second>] [-d <seconds>] [-t <threads>] "
+            "[-m <events>:<reservations>:<tickets>] "
+            "[-c <requests in flight per thread>] [-n <tickets per "
+            "reservation>]\n",
+            bin_file);
+    fprintf(stderr, "%s\n", message.c_str());
+    exit(1);
+  }
+
+  unsigned long check_number(const char *number_str, unsigned long minimum,
+                             unsigned long maximum, int status) {
+    unsigned long number = strtoul(number_str, nullptr, 10);
+    if (*number_str == '\0' || number < minimum || number > maximum ||
+        std::any_of(number_str, number_str + strlen(number_str),
+                    [](char c) { return !isdigit(c); })) {
+      exit_program(status);
+    }
+    return number;
+  }
+
+  void check_mix(const char *mix_str) {
+    unsigned parts[REQUEST_TYPES];
+    char end;
+    if (sscanf(mix_str, "%u:%u:%u%c", &parts[0], &parts[1], &parts[2],
+               &end) != REQUEST_TYPES ||
+        parts[0] + parts[1] + parts[2] == 0) {
+      exit_program(WRONG_MIX);
+    }
+    for (int i = 0; i < REQUEST_TYPES; i++) {
+      mix[i] = parts[i];
+    }
+  }
+
+  void check_parameters(int argc, char *argv[]) {
+    const char *flags = "a:p:r:d:t:m:c:n:";
+    int opt;
+    while ((opt = getopt(argc, argv, flags)) != -1)
+      switch (opt) {
+      case 'a':
+        if (inet_pton(AF_INET, optarg, &server_address.sin_addr) != 1) {
+          exit_program(WRONG_ADDRESS);
+        }
+        break;
+      case 'p':
+        server_address.sin_port =
+            htons((uint16_t)check_number(optarg, 1, UINT16_MAX, WRONG_PORT));
+        break;
+      case 'r':
+        rate = check_number(optarg, 1, MAX_RATE, WRONG_RATE);
+        break;
+      case 'd':
+        duration = check_number(optarg, 1, MAX_DURATION, WRONG_DURATION);
+        break;
+      case 't':
+        threads = (int)check_number(optarg, 1, MAX_THREADS, WRONG_THREADS);
+        break;
+      case 'm':
+        check_mix(optarg);
+        break;
+      case 'c':
+        in_flight = check_number(optarg, 1, MAX_IN_FLIGHT, WRONG_IN_FLIGHT);
+        break;
+      case 'n':
+        tickets = (uint16_t)check_number(
+            optarg, 1, tickets_message::max_tickets, WRONG_TICKETS);
+        break;
+      default:
+        exit_program(WRONG_FLAGS);
+      }
+    if (optind != argc) {
+      exit_program(WRONG_FLAGS);
+    }
+  }
+
+public:
+  [[nodiscard]] const struct sockaddr_in &get_server_address() const {
+    return server_address;
+  }
+
+  [[nodiscard]] unsigned long get_rate() const { return rate; }
+
+  [[nodiscard]] unsigned long get_duration() const { return duration; }
+
+  [[nodiscard]] int get_threads() const { return threads; }
+
+  [[nodiscard]] unsigned get_mix(int type) const { return mix[type]; }
+
+  [[nodiscard]] unsigned long get_in_flight() const { return in_flight; }
+
+  [[nodiscard]] uint16_t get_tickets() const { return tickets; }
+
+private:
+  const char *bin_file;
+  struct sockaddr_in server_address {};
+  unsigned long rate{DEFAULT_RATE};
+  unsigned long duration{DEFAULT_DURATION};
+  int threads{DEFAULT_THREADS};
+  unsigned mix[REQUEST_TYPES]{1, 1, 1};
+  unsigned long in_flight{DEFAULT_IN_FLIGHT};
+  uint16_t tickets{DEFAULT_TICKETS};
+};
+
+static int connect_socket(const struct sockaddr_in &server_address) {
+  int socket_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  ENSURE(socket_fd >= 0);
+  CHECK_ERRNO(connect(socket_fd, (const struct sockaddr *)&server_address,
+                      (socklen_t)sizeof(server_address)));
+  return socket_fd;
+}
+
+// Asks for the events once, so that reservations are made for events the
+// server really has.
+static std::vector<uint32_t>
+fetch_event_ids(const struct sockaddr_in &server_address) {
+  int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  ENSURE(socket_fd >= 0);
+  CHECK_ERRNO(connect(socket_fd, (const struct sockaddr *)&server_address,
+                      (socklen_t)sizeof(server_address)));
+  struct timeval timeout {1, 0};
+  CHECK_ERRNO(setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                         sizeof(timeout)));
+
+  std::vector<char> reply(BUFFER_SIZE);
+  char request[get_events_message::length];
+  get_events_message::encode(request);
+  ssize_t length = -1;
+  for (int attempt = 0; attempt < 3 && length < 0; attempt++) {
+    ENSURE(send(socket_fd, request, sizeof(request), 0) ==
+           (ssize_t)sizeof(request));
+    length = recv(socket_fd, reply.data(), reply.size(), 0);
+  }
+  close(socket_fd);
+  if (length < (ssize_t)events_message::length ||
+      (uint8_t)reply[0] != EVENTS) {
+    fprintf(stderr, "Error: no EVENTS reply from the server\n");
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<uint32_t> event_ids;
+  size_t index = events_message::length;
+  while (index + event_entry::length <= (size_t)length) {
+    const char *entry = reply.data() + index;
+    event_ids.push_back(event_entry::get<0>(entry));
+    index += event_entry::length_with(event_entry::get<2>(entry));
+  }
+  ENSURE(!event_ids.empty());
+  return event_ids;
+}
+
+struct kept_reservation {
+  uint32_t reservation_id;
+  char cookie[COOKIE_SIZE];
+};
+
+// One sending thread: a fixed set of sockets, each with at most one request
+// in flight, so that every reply is matched to its request by the socket it
+// arrives on.
+class LoadWorker {
+public:
+  LoadWorker(const LoadParameters &parameters,
+             const std::vector<uint32_t> &event_ids, int index)
+      : parameters(parameters), event_ids(event_ids),
+        slots(parameters.get_in_flight()), reply(BUFFER_SIZE),
+        kept(RESERVATIONS_KEPT), random_state(0x9e3779b9u * (index + 1)) {
+    interval_ns = (double)NS_PER_SECOND * parameters.get_threads() /
+                  (double)parameters.get_rate();
+    // Threads are staggered, so that together they send at an even pace
+    first_offset_ns = interval_ns * index / parameters.get_threads();
+    mix_total = 0;
+    for (int type = 0; type < REQUEST_TYPES; type++) {
+      mix_total += parameters.get_mix(type);
+    }
+
+    epoll_fd = epoll_create1(0);
+    ENSURE(epoll_fd >= 0);
+    for (size_t i = 0; i < slots.size(); i++) {
+      open_slot(i);
+      free_slots.push_back(i);
+    }
+  }
+
+  LoadWorker(const LoadWorker &) = delete;
+  LoadWorker &operator=(const LoadWorker &) = delete;
+
+  virtual ~LoadWorker() {
+    for (request_slot &slot : slots) {
+      close(slot.socket_fd);
+    }
+    close(epoll_fd);
+  }
+
+  void run(uint64_t start, uint64_t end) {
+    uint64_t sent_requests = 0;
+    uint64_t next_send = start + (uint64_t)first_offset_ns;
+    uint64_t last_expiry_scan = start;
+    struct epoll_event events[64];
+
+    while (true) {
+      uint64_t now = now_ns();
+      // Requests wait for a free socket past their scheduled time, but not
+      // past the end of the run by more than a reply timeout
+      bool sending = next_send < end && now < end + REPLY_TIMEOUT_NS;
+      while (sending && next_send <= now && !free_slots.empty()) {
+        send_request(next_send, now);
+        sent_requests++;
+        next_send = start + (uint64_t)(first_offset_ns +
+                                       interval_ns * (double)sent_requests);
+        sending = next_send < end;
+      }
+      if (now - last_expiry_scan >= EXPIRY_SCAN_NS) {
+        expire_lost(now);
+        last_expiry_scan = now;
+      }
+      if (!sending && free_slots.size() == slots.size()) {
+        break;
+      }
+
+      int timeout_ms = (int)(EXPIRY_SCAN_NS / 1000000);
+      if (sending && !free_slots.empty()) {
+        timeout_ms = next_send > now ? (int)((next_send - now) / 1000000) : 0;
+      }
+      int ready = epoll_wait(epoll_fd, events, 64, timeout_ms);
+      if (ready < 0) {
+        ENSURE(errno == EINTR);
+        continue;
+      }
+      uint64_t received = now_ns();
+      for (int i = 0; i < ready; i++) {
+        receive_reply(events[i].data.u64, received);
+      }
+    }
+    // Requests still scheduled were never sent: all sockets were waiting
+    // for replies until the run was over
+    uint64_t finished = now_ns();
+    while (next_send < end) {
+      type_statistics &type_statistics = statistics[choose_type()];
+      type_statistics.unsent++;
+      type_statistics.record_failure(finished - next_send, 0);
+      sent_requests++;
+      next_send = start + (uint64_t)(first_offset_ns +
+                                     interval_ns * (double)sent_requests);
+    }
+  }
+
+  [[nodiscard]] const type_statistics &get_statistics(int type) const {
+    return statistics[type];
+  }
+
+
+private:
+  struct request_slot {
+    int socket_fd{-1};
+    int type{EVENTS_REQUEST};
+    uint64_t scheduled{0};
+    uint64_t sent{0};
+  };
+
+  void open_slot(size_t i) {
+    slots[i].socket_fd = connect_socket(parameters.get_server_address());
+    struct epoll_event event {};
+    event.events = EPOLLIN;
+    event.data.u64 = i;
+    CHECK_ERRNO(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, slots[i].socket_fd, &event));
+  }
+
+  uint32_t next_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+  }
+
+  int choose_type() {
+    uint32_t pick = next_random() % mix_total;
+    int type = 0;
+    while (pick >= parameters.get_mix(type)) {
+      pick -= parameters.get_mix(type);
+      type++;
+    }
+    // GET_TICKETS needs a reservation to collect; until there is one,
+    // a reservation is made instead
+    if (type == TICKETS_REQUEST && kept_count == 0) {
+      type = RESERVATION_REQUEST;
+    }
+    return type;
+  }
+
+  void send_request(uint64_t scheduled, uint64_t now) {
+    size_t i = free_slots.back();
+    free_slots.pop_back();
+    request_slot &slot = slots[i];
+    slot.type = choose_type();
+    slot.scheduled = scheduled;
+    slot.sent = now;
+
+    char request[max_request_length];
+    size_t length = 0;
+    switch (slot.type) {
+    case EVENTS_REQUEST:
+      length = get_events_message::encode(request);
+      break;
+    case RESERVATION_REQUEST:
+      length = get_reservation_message::encode(
+          request, event_ids[next_random() % event_ids.size()],
+          parameters.get_tickets());
+      break;
+    default: {
+      // The newest reservations are collected first, before they expire;
+      // once all were collected the last one is collected again
+      const kept_reservation &r = kept[(kept_next + RESERVATIONS_KEPT - 1) %
+                                       RESERVATIONS_KEPT];
+      if (kept_count > 1) {
+        kept_next = (kept_next + RESERVATIONS_KEPT - 1) % RESERVATIONS_KEPT;
+        kept_count--;
+      }
+      length = get_tickets_message::encode(request, r.reservation_id, r.cookie);
+    }
+    }
+    statistics[slot.type].sent++;
+    if (send(slot.socket_fd, request, length, 0) != (ssize_t)length) {
+      // A full socket buffer is the same to the server as a lost datagram
+      ENSURE(errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED);
+    }
+  }
+
+  void receive_reply(size_t i, uint64_t received) {
+    request_slot &slot = slots[i];
+    ssize_t length = recv(slot.socket_fd, reply.data(), reply.size(), 0);
+    if (length <= 0) {
+      // ECONNREFUSED when nothing listens; the request expires as lost
+      return;
+    }
+    type_statistics &type_statistics = statistics[slot.type];
+    type_statistics.latency.record(received - slot.scheduled);
+    type_statistics.service_time.record(received - slot.sent);
+    type_statistics.replied++;
+
+    auto message_id = (uint8_t)reply[0];
+    if (message_id == BAD_REQUEST) {
+      type_statistics.bad_requests++;
+    } else if (message_id == RESERVATION &&
+               length == (ssize_t)reservation_message::length) {
+      kept_reservation &r = kept[kept_next];
+      r.reservation_id = reservation_message::get<0>(reply.data());
+      memcpy(r.cookie, reservation_message::get<3>(reply.data()), COOKIE_SIZE);
+      kept_next = (kept_next + 1) % RESERVATIONS_KEPT;
+      kept_count = std::min(kept_count + 1, (size_t)RESERVATIONS_KEPT);
+    }
+    free_slots.push_back(i);
+  }
+
+  // A late reply must not be taken for the reply to the next request, so
+  // the socket of a lost request is replaced with a new one.
+  void expire_lost(uint64_t now) {
+    size_t in_flight_count = slots.size() - free_slots.size();
+    if (in_flight_count == 0) {
+      return;
+    }
+    std::vector<bool> is_free(slots.size(), false);
+    for (size_t i : free_slots) {
+      is_free[i] = true;
+    }
+    for (size_t i = 0; i < slots.size(); i++) {
+      if (!is_free[i] && now - slots[i].sent > REPLY_TIMEOUT_NS) {
+        statistics[slots[i].type].lost++;
+        statistics[slots[i].type].record_failure(now - slots[i].scheduled,
+                                                 now - slots[i].sent);
+        close(slots[i].socket_fd);
+        open_slot(i);
+        free_slots.push_back(i);
+      }
+    }
+  }
+
+  const LoadParameters &parameters;
+  const std::vector<uint32_t> &event_ids;
+  std::vector<request_slot> slots;
+  std::vector<size_t> free_slots;
+  std::vector<char> reply;
+  std::vector<kept_reservation> kept;
+  size_t kept_next{0};
+  size_t kept_count{0};
+  type_statistics statistics[REQUEST_TYPES];
+  uint32_t random_state;
+  uint32_t mix_total;
+  double interval_ns;
+  double first_offset_ns;
+  int epoll_fd;
+};
+
+static double to_microseconds(uint64_t ns) { return (double)ns / 1000.0; }
+
+static void print_statistics(const char *name, const type_statistics &s,
+                             double seconds) {
+  printf("{\"loadgen\": \"%s\", \"sent\": %lu, \"replied\": %lu, "
+         "\"bad_request\": %lu, \"lost\": %lu, \"unsent\": %lu, "
+         "\"rate\": %.1f, \"mean_us\": %.1f, \"p50_us\": %.1f, "
+         "\"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+         "\"max_us\": %.1f, \"uncorrected_p99_us\": %.1f}\n",
+         name, (unsigned long)s.sent, (unsigned long)s.replied,
+         (unsigned long)s.bad_requests, (unsigned long)s.lost,
+         (unsigned long)s.unsent,
+         (double)s.replied / seconds, s.latency.get_mean() / 1000.0,
+         to_microseconds(s.latency.percentile(50)),
+         to_microseconds(s.latency.percentile(90)),
+         to_microseconds(s.latency.percentile(99)),
+         to_microseconds(s.latency.percentile(99.9)),
+         to_microseconds(s.latency.get_max()),
+         to_microseconds(s.service_time.percentile(99)));
+}
+
+int main(int argc, char *argv[]) {
+  LoadParameters parameters(argc, argv);
+  std::vector<uint32_t> event_ids =
+      fetch_event_ids(parameters.get_server_address());
+
+  std::vector<std::unique_ptr<LoadWorker>> workers;
+  for (int i = 0; i < parameters.get_threads(); i++) {
+    workers.push_back(std::make_unique<LoadWorker>(parameters, event_ids, i));
+  }
+
+  uint64_t start = now_ns() + NS_PER_SECOND / 100;
+  uint64_t end = start + parameters.get_duration() * NS_PER_SECOND;
+  std::vector<std::thread> threads;
+  for (auto &worker : workers) {
+    threads.emplace_back([&worker, start, end]() { worker->run(start, end); });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  double seconds = (double)parameters.get_duration();
+  type_statistics total;
+  for (int type = 0; type < REQUEST_TYPES; type++) {
+    type_statistics merged;
+    for (auto &worker : workers) {
+      merged.merge(worker->get_statistics(type));
+    }
+    if (parameters.get_mix(type) > 0 || merged.sent > 0) {
+      print_statistics(request_names[type], merged, seconds);
+    }
+    total.merge(merged);
+  }
+  print_statistics("total", total, seconds);
+  if (total.unsent > 0) {
+    fprintf(stderr,
+            "%lu scheduled requests were never sent: raise -c or -t, or "
+            "lower -r\n",
+            (unsigned long)total.unsent);
+  }
+}
@@ -0,0 +1,207 @@
+// Wire format of the ticket reservation protocol, shared by both servers.
+// Every message is described once as a list of fields; the offsets, the
+// lengths and the byte swapping of each field are computed at compile time.
+#ifndef TICKET_PROTOCOL_H
+#define TICKET_PROTOCOL_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#define GET_EVENTS (uint8_t)1
+#define EVENTS (uint8_t)2
+#define GET_RESERVATION (uint8_t)3
+#define RESERVATION (uint8_t)4
+#define GET_TICKETS (uint8_t)5
+#define TICKETS (uint8_t)6
+#define BAD_REQUEST (uint8_t)255
+
+#define TICKET_OCTETS 7
+#define COOKIE_SIZE 48
+// The largest payload of a UDP datagram over IPv4
+#define BUFFER_SIZE 65507
+
+// Multi-octet numbers are sent in network byte order
+template <typename T> constexpr T to_network_order(T number) {
+  static_assert(std::is_unsigned_v<T>, "wire numbers are unsigned");
+  if constexpr (sizeof(T) == 1 || __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__) {
+    return number;
+  } else if constexpr (sizeof(T) == 2) {
+    return __builtin_bswap16(number);
+  } else if constexpr (sizeof(T) == 4) {
+    return __builtin_bswap32(number);
+  } else {
+    static_assert(sizeof(T) == 8, "no such field width in the protocol");
+    return __builtin_bswap64(number);
+  }
+}
+
+// A binary number field
+template <typename T> struct number_field {
+  using type = T;
+  static constexpr size_t size = sizeof(T);
+
+  static void write(char *destination, T value) {
+    value = to_network_order(value);
+    memcpy(destination, &value, size);
+  }
+
+  static T read(const char *source) {
+    T value;
+    memcpy(&value, source, size);
+    return to_network_order(value);
+  }
+};
+
+// A field of N raw octets, read in place
+template <size_t N> struct bytes_field {
+  using type = const char *;
+  static constexpr size_t size = N;
+
+  static void write(char *destination, const char *value) {
+    memcpy(destination, value, size);
+  }
+
+  static const char *read(const char *source) { return source; }
+};
+
+using event_id_field = number_field<uint32_t>;
+using reservation_id_field = number_field<uint32_t>;
+using ticket_count_field = number_field<uint16_t>;
+using description_length_field = number_field<uint8_t>;
+using expiration_time_field = number_field<uint64_t>;
+using cookie_field = bytes_field<COOKIE_SIZE>;
+
+// Fixed fields laid out one after another from offset Start
+template <size_t Start, typename... Fields> struct field_layout {
+  using fields = std::tuple<Fields...>;
+  template <size_t I> using field = std::tuple_element_t<I, fields>;
+
+  static constexpr size_t length = Start + (Fields::size + ... + 0);
+
+  template <size_t I> static constexpr size_t offset() {
+    constexpr size_t sizes[] = {Fields::size..., 0};
+    size_t result = Start;
+    for (size_t i = 0; i < I; i++) {
+      result += sizes[i];
+    }
+    return result;
+  }
+
+  template <size_t I>
+  static typename field<I>::type get(const char *message) {
+    return field<I>::read(message + offset<I>());
+  }
+
+  template <size_t I>
+  static void set(char *message, typename field<I>::type value) {
+    field<I>::write(message + offset<I>(), value);
+  }
+
+protected:
+  template <size_t... I>
+  static void write_fields([[maybe_unused]] char *message,
+                           std::index_sequence<I...>,
+                           typename Fields::type... values) {
+    (field<I>::write(message + offset<I>(), values), ...);
+  }
+};
+
+// A message starts with its one octet message_id
+template <uint8_t Id, typename... Fields>
+struct message_layout : field_layout<1, Fields...> {
+  static constexpr uint8_t id = Id;
+
+  // Writes the message and returns its length
+  static size_t encode(char *message, typename Fields::type... values) {
+    message[0] = (char)Id;
+    message_layout::write_fields(message, std::index_sequence_for<Fields...>{},
+                                 values...);
+    return message_layout::length;
+  }
+};
+
+using get_events_message = message_layout<GET_EVENTS>;
+using get_reservation_message =
+    message_layout<GET_RESERVATION, event_id_field, ticket_count_field>;
+using get_tickets_message =
+    message_layout<GET_TICKETS, reservation_id_field, cookie_field>;
+using reservation_message =
+    message_layout<RESERVATION, reservation_id_field, event_id_field,
+                   ticket_count_field, cookie_field, expiration_time_field>;
+// BAD_REQUEST repeats the event_id or the reservation_id it refuses
+using bad_request_message =
+    message_layout<BAD_REQUEST, number_field<uint32_t>>;
+
+// EVENTS is its message_id followed by as many event entries as fit
+using events_message = message_layout<EVENTS>;
+
+// event_id, ticket_count and description_length, then the description
+struct event_entry : field_layout<0, event_id_field, ticket_count_field,
+                                  description_length_field> {
+  static constexpr size_t ticket_count_offset = offset<1>();
+
+  static constexpr size_t length_with(size_t description_length) {
+    return length + description_length;
+  }
+
+  static size_t encode(char *entry, uint32_t event_id, uint16_t ticket_count,
+                       const char *description, uint8_t description_length) {
+    write_fields(entry, std::make_index_sequence<3>{}, event_id, ticket_count,
+                 description_length);
+    memcpy(entry + length, description, description_length);
+    return length_with(description_length);
+  }
+};
+
+// reservation_id and ticket_count, then ticket_count tickets
+struct tickets_message
+    : message_layout<TICKETS, reservation_id_field, ticket_count_field> {
+  static constexpr size_t max_tickets = (BUFFER_SIZE - length) / TICKET_OCTETS;
+
+  static constexpr size_t length_with(size_t ticket_count) {
+    return length + ticket_count * TICKET_OCTETS;
+  }
+
+  static char *ticket(char *message, size_t index) {
+    return message + length_with(index);
+  }
+};
+
+// Length of every request by its message_id, 0 for the ids a client
+// never sends
+template <typename... Requests>
+constexpr std::array<uint8_t, 256> make_request_lengths() {
+  std::array<uint8_t, 256> lengths{};
+  ((lengths[Requests::id] = (uint8_t)Requests::length), ...);
+  return lengths;
+}
+
+inline constexpr std::array<uint8_t, 256> request_lengths =
+    make_request_lengths<get_events_message, get_reservation_message,
+                         get_tickets_message>();
+
+inline constexpr size_t max_request_length =
+    std::max({get_events_message::length, get_reservation_message::length,
+              get_tickets_message::length});
+
+// Requests have a fixed length, so a datagram is accepted only if its
+// length is exactly the one of its message_id
+inline bool is_valid_request(const char *message, size_t length) {
+  return length > 0 && request_lengths[(uint8_t)message[0]] == length;
+}
+
+static_assert(get_events_message::length == 1);
+static_assert(get_reservation_message::length == 7);
+static_assert(get_tickets_message::length == 53);
+static_assert(reservation_message::length == 67);
+static_assert(bad_request_message::length == 5);
+static_assert(event_entry::ticket_count_offset == 4);
+static_assert(tickets_message::length == 7);
+
+#endif // TICKET_PROTOCOL_H
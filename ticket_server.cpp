@@ -1,52 +1,117 @@
 #include <algorithm>
 #include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdint>
+#include <csignal>
 #include <cstring>
 #include <ctime>
+#include <fcntl.h>
 #include <iostream>
-#include <map>
+#include <linux/io_uring.h>
+#include <memory>
+#include <mutex>
 #include <netinet/in.h>
-#include <random>
+#include <poll.h>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <thread>
 #include <unistd.h>
 #include <utility>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ticket_protocol.h"
+
 // Aliases for commonly used types
 using std::string;
-using eventMap = std::map<int, struct event>;
-using reservationMap = std::map<int, struct reservation>;
 
 // Global variables
 #define DEFAULT_PORT 2022
 #define DEFAULT_TIMEOUT 5
-
-#define GET_EVENTS (uint8_t)1
-#define EVENTS (uint8_t)2
-#define GET_RESERVATION (uint8_t)3
-#define RESERVATION (uint8_t)4
-#define GET_TICKETS (uint8_t)5
-#define TICKETS (uint8_t)6
-#define BAD_REQUEST (uint8_t)255
+#define DEFAULT_BATCH_SIZE 1
+#define MAX_BATCH_SIZE 1024
+#define DEFAULT_WORKERS 1
+#define MAX_WORKERS 256
+#define URING_DEFAULT_SLOTS 64
+// Longer than any request, so that longer datagrams are still seen as such
+#define URING_READ_BUFFER_SIZE 64
+#define URING_BUFFER_GROUP 0
+#define EPOLL_MAX_EVENTS 64
+// Datagrams read from one ready socket before the others get their turn
+#define SOCKET_READS_PER_WAKEUP 64
 
 #define MIN_COOKIE_CHAR 33
 #define MAX_COOKIE_CHAR 126
-
-#define EVENT_CONST_OCTETS 7
-#define TICKET_OCTETS 7
-#define COOKIE_SIZE 48
+#define COOKIE_CHARSET_SIZE (MAX_COOKIE_CHAR - MIN_COOKIE_CHAR + 1)
+// Largest multiple of COOKIE_CHARSET_SIZE not greater than 256
+#define COOKIE_BYTE_LIMIT (256 - 256 % COOKIE_CHARSET_SIZE)
+#define COOKIE_ENTROPY_SIZE 4096
+// Random bytes are mapped to cookie characters in blocks of this size
+#define COOKIE_MAP_BLOCK 16
+#define COOKIE_SECRET_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+#define FIRST_RESERVATION_ID 1000000
+#define INITIAL_TABLE_CAPACITY 1024
+// Archive records are mapped in chunks of 2^ARCHIVE_CHUNK_SHIFT records
+#define ARCHIVE_CHUNK_SHIFT 16
+#define ARCHIVE_MAX_CHUNKS ((size_t)1 << (31 - ARCHIVE_CHUNK_SHIFT))
 #define MAX_DESCRIPTION_SIZE 80
-
-#define GET_EVENTS_MSG_LENGTH 1
-#define GET_RESERVATION_MSG_LENGTH 7
-#define GET_TICKETS_MSG_LENGTH 53
-
-#define BUFFER_SIZE 65507
-static char ticket_charset[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+#define SNAPSHOT_MAGIC "TKTSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGNMENT 8
+#define JOURNAL_MAGIC "TKTJRNL"
+#define JOURNAL_VERSION 1
+// Events files smaller than this are parsed on one thread
+#define LOAD_MIN_CHUNK_SIZE (1 << 20)
+#define STATS_INTERVAL_MS 1000
+// Latencies are counted exactly up to 2^STATS_HISTOGRAM_SUB_BITS ns and
+// then in 2^(STATS_HISTOGRAM_SUB_BITS - 1) buckets per power of two
+#define STATS_HISTOGRAM_SUB_BITS 4
+#define STATS_HISTOGRAM_BUCKETS                                                \
+  ((64 - STATS_HISTOGRAM_SUB_BITS) * (1 << (STATS_HISTOGRAM_SUB_BITS - 1)) +   \
+   (1 << STATS_HISTOGRAM_SUB_BITS))
+// GET_EVENTS, GET_RESERVATION and GET_TICKETS
+#define REQUEST_TYPES 3
+// Records logged by one worker and not yet written out, a power of two
+#define LOG_RING_RECORDS 8192
+#define LOG_FLUSH_INTERVAL_MS 10
+// Each worker remembers the last RESERVATION reply of up to
+// 2^DEDUP_CACHE_BITS clients
+#define DEDUP_CACHE_BITS 12
+#define DEDUP_CACHE_ENTRIES ((size_t)1 << DEDUP_CACHE_BITS)
+// Ticket count changes a worker's EVENTS datagram can catch up with one by
+// one, a power of two; a worker further behind patches every event
+#define EVENTS_CHANGE_LOG 4096
+// The token buckets of 2^RATE_LIMIT_BITS clients are kept in each of the
+// 2^RATE_LIMIT_PARTITION_BITS partitions; a client takes one of the
+// RATE_LIMIT_PROBES slots after its hash
+#define RATE_LIMIT_PARTITION_BITS 6
+#define RATE_LIMIT_BITS 10
+#define RATE_LIMIT_ENTRIES ((size_t)1 << RATE_LIMIT_BITS)
+#define RATE_LIMIT_PROBES 8
+#define MAX_RATE_LIMIT 1000000
+// Batch size of the priority mode when -b does not set one
+#define PRIORITY_BATCH_SIZE 64
+// GET_TICKETS, GET_RESERVATION, GET_EVENTS and malformed packets
+#define PRIORITY_CLASSES 4
+
+static constexpr char ticket_charset[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+#define TICKET_CHARSET_SIZE (sizeof(ticket_charset) - 1)
 
 #define PRINT_ERRNO()                                                          \
   do {                                                                         \
@@ -74,69 +139,574 @@ static char ticket_charset[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
     }                                                                          \
   } while (0)
 
+enum IO_BACKEND {
+  SOCKETS_BACKEND = 0,
+  URING_BACKEND = 1,
+};
+
+enum COOKIE_MODE {
+  RANDOM_COOKIES = 0,
+  HMAC_COOKIES = 1,
+};
+
+// Why a request was answered with BAD_REQUEST
+enum BAD_REQUEST_REASON {
+  NOT_REFUSED = 0,
+  ZERO_TICKETS = 1,
+  UNKNOWN_EVENT = 2,
+  TOO_MANY_TICKETS = 3,
+  NOT_ENOUGH_TICKETS = 4,
+  UNKNOWN_RESERVATION = 5,
+  WRONG_COOKIE = 6,
+  RESERVATION_EXPIRED = 7,
+  BAD_REQUEST_REASONS = 8,
+};
+
 #ifdef NDEBUG
 const bool debug = false;
 #else
 const bool debug = true;
 #endif
 
-// Structs used for server communication
-struct event {
-  string description;
-  uint8_t description_length;
-  uint16_t tickets_available;
+// Events have dense ids 0, 1, ..., so they are kept in parallel arrays:
+// ticket counts in one array and all descriptions packed into one blob,
+// where the description of event i spans offsets i to i + 1.
+class EventCatalog {
+public:
+  // Event i is described by lines 2i and 2i + 1 of the file, as when it is
+  // read line by line. The mapped file is cut into chunks at line starts and
+  // parsed on all cores in two passes: the first counts lines and their bytes
+  // in every chunk, so prefix sums give each chunk its first line and place
+  // in the blob, and the second writes into the preallocated arrays.
+  void load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    ENSURE(fd >= 0);
+    struct stat file_stat {};
+    ENSURE(fstat(fd, &file_stat) == 0);
+    size_t size = (size_t)file_stat.st_size;
+    const char *file = nullptr;
+    if (size > 0) {
+      void *memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ENSURE(memory != MAP_FAILED);
+      madvise(memory, size, MADV_SEQUENTIAL);
+      file = (const char *)memory;
+    }
+    close(fd);
+
+    std::vector<load_chunk> chunks = split_into_chunks(file, size);
+    run_in_parallel(chunks.size(),
+                    [&](size_t i) { count_lines(file, chunks[i]); });
+
+    size_t lines = 0;
+    size_t description_bytes = 0;
+    for (load_chunk &chunk : chunks) {
+      chunk.first_line = lines;
+      chunk.first_description_byte = description_bytes;
+      description_bytes += chunk.line_bytes[lines % 2];
+      lines += chunk.lines;
+    }
+    // A description without its ticket count at the end is not an event
+    event_count = lines / 2;
+    owned_descriptions =
+        std::unique_ptr<char[]>(new char[description_bytes + 1]);
+    owned_description_offsets =
+        std::unique_ptr<uint32_t[]>(new uint32_t[event_count + 1]);
+    owned_description_offsets[0] = 0;
+    descriptions = owned_descriptions.get();
+    description_offsets = owned_description_offsets.get();
+    tickets_available =
+        std::make_unique<std::atomic<uint16_t>[]>(event_count);
+
+    run_in_parallel(chunks.size(),
+                    [&](size_t i) { parse_chunk(file, chunks[i]); });
+    if (file != nullptr) {
+      munmap((void *)file, size);
+    }
+  }
+
+  // Uses the descriptions of a snapshot in place; they must outlive the
+  // catalog. Only the ticket counts are copied, as they change.
+  void restore(size_t count, const uint32_t *offsets, const char *blob,
+               const uint16_t *tickets) {
+    event_count = count;
+    description_offsets = offsets;
+    descriptions = blob;
+    tickets_available = std::make_unique<std::atomic<uint16_t>[]>(count);
+    for (size_t i = 0; i < count; i++) {
+      tickets_available[i].store(tickets[i], std::memory_order_relaxed);
+    }
+  }
+
+  [[nodiscard]] size_t size() const { return event_count; }
+
+  [[nodiscard]] size_t get_description_bytes() const {
+    return description_offsets[event_count];
+  }
+
+  [[nodiscard]] const char *get_descriptions() const { return descriptions; }
+
+  [[nodiscard]] const uint32_t *get_description_offsets() const {
+    return description_offsets;
+  }
+
+  [[nodiscard]] bool contains(int event_id) const {
+    return event_id >= 0 && (size_t)event_id < event_count;
+  }
+
+  std::atomic<uint16_t> &get_tickets(int event_id) {
+    return tickets_available[event_id];
+  }
+
+  [[nodiscard]] const char *get_description(int event_id) const {
+    return descriptions + description_offsets[event_id];
+  }
+
+  [[nodiscard]] uint8_t get_description_length(int event_id) const {
+    return (uint8_t)(description_offsets[event_id + 1] -
+                     description_offsets[event_id]);
+  }
+
+private:
+  struct load_chunk {
+    size_t begin;
+    size_t end;
+    size_t lines{0};
+    // Bytes of the chunk's lines at even and odd positions within it
+    size_t line_bytes[2]{0, 0};
+    size_t first_line{0};
+    size_t first_description_byte{0};
+  };
+
+  static std::vector<load_chunk> split_into_chunks(const char *file,
+                                                   size_t size) {
+    size_t count = std::max<size_t>(1, std::thread::hardware_concurrency());
+    count = std::max<size_t>(1, std::min(count, size / LOAD_MIN_CHUNK_SIZE));
+    std::vector<load_chunk> chunks;
+    size_t begin = 0;
+    for (size_t i = 1; i <= count && begin < size; i++) {
+      size_t end = size;
+      if (i < count) {
+        // The chunk ends just after the first newline past its share
+        size_t share_end = std::max(begin, size * i / count);
+        const void *newline = memchr(file + share_end, '\n', size - share_end);
+        end = newline == nullptr ? size : (const char *)newline - file + 1;
+      }
+      chunks.push_back({begin, end});
+      begin = end;
+    }
+    return chunks;
+  }
+
+  template <typename F>
+  static void for_each_line(const char *file, const load_chunk &chunk,
+                            F visit) {
+    size_t position = chunk.begin;
+    size_t line = 0;
+    while (position < chunk.end) {
+      const void *newline =
+          memchr(file + position, '\n', chunk.end - position);
+      size_t line_end =
+          newline == nullptr ? chunk.end : (const char *)newline - file;
+      visit(line++, file + position, line_end - position);
+      position = line_end + 1;
+    }
+  }
+
+  static void count_lines(const char *file, load_chunk &chunk) {
+    for_each_line(file, chunk, [&](size_t line, const char *, size_t length) {
+      chunk.line_bytes[line % 2] += length;
+      chunk.lines++;
+    });
+  }
+
+  void parse_chunk(const char *file, const load_chunk &chunk) {
+    size_t description_byte = chunk.first_description_byte;
+    for_each_line(file, chunk,
+                  [&](size_t line, const char *text, size_t length) {
+                    size_t event_id = (chunk.first_line + line) / 2;
+                    if (event_id >= event_count) {
+                      return;
+                    }
+                    if ((chunk.first_line + line) % 2 == 0) {
+                      memcpy(owned_descriptions.get() + description_byte,
+                             text, length);
+                      description_byte += length;
+                      owned_description_offsets[event_id + 1] =
+                          (uint32_t)description_byte;
+                    } else {
+                      tickets_available[event_id].store(
+                          parse_ticket_count(text, text + length),
+                          std::memory_order_relaxed);
+                    }
+                  });
+  }
+
+  // Same as casting strtoul of the line to uint16_t
+  static uint16_t parse_ticket_count(const char *begin, const char *end) {
+    while (begin < end && isspace(*begin)) {
+      begin++;
+    }
+    unsigned long count = 0;
+    while (begin < end && isdigit(*begin)) {
+      count = count * 10 + (*begin - '0');
+      begin++;
+    }
+    return (uint16_t)count;
+  }
+
+  template <typename F> static void run_in_parallel(size_t tasks, F task) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < tasks; i++) {
+      threads.emplace_back(task, i);
+    }
+    if (tasks > 0) {
+      task(0);
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+
+  size_t event_count{0};
+  const char *descriptions{nullptr};
+  const uint32_t *description_offsets{nullptr};
+  std::unique_ptr<char[]> owned_descriptions;
+  std::unique_ptr<uint32_t[]> owned_description_offsets;
+  std::unique_ptr<std::atomic<uint16_t>[]> tickets_available;
+};
+
+// Source of cookies for all reservations made by one thread: random bytes
+// are fetched with getrandom a few kilobytes at a time and then used up.
+// The modulo below is a single conditional subtraction
+static_assert(COOKIE_BYTE_LIMIT == 2 * COOKIE_CHARSET_SIZE);
+static_assert(COOKIE_ENTROPY_SIZE % COOKIE_MAP_BLOCK == 0);
+static_assert(SHA256_DIGEST_SIZE % COOKIE_MAP_BLOCK == 0);
+
+// Maps COOKIE_MAP_BLOCK random bytes to cookie characters, appended to
+// `cookie` at `filled`. Bytes above the last full multiple of the charset
+// size are skipped, so every cookie character is equally likely. Up to
+// COOKIE_MAP_BLOCK characters are written past `filled`, but only the
+// accepted ones are counted; returns the new number of characters.
+static size_t map_cookie_block(const uint8_t *bytes, char *cookie,
+                               size_t filled) {
+#ifdef __SSE2__
+  __m128i block = _mm_loadu_si128((const __m128i *)bytes);
+  __m128i accepted = _mm_cmpeq_epi8(
+      _mm_min_epu8(block, _mm_set1_epi8((char)(COOKIE_BYTE_LIMIT - 1))),
+      block);
+  __m128i wrapped = _mm_cmpeq_epi8(
+      _mm_max_epu8(block, _mm_set1_epi8((char)COOKIE_CHARSET_SIZE)), block);
+  __m128i mapped = _mm_add_epi8(
+      _mm_sub_epi8(block, _mm_and_si128(wrapped, _mm_set1_epi8(
+                                                     (char)COOKIE_CHARSET_SIZE))),
+      _mm_set1_epi8((char)MIN_COOKIE_CHAR));
+  alignas(16) char characters[COOKIE_MAP_BLOCK];
+  _mm_store_si128((__m128i *)characters, mapped);
+  auto mask = (unsigned)_mm_movemask_epi8(accepted);
+#pragma GCC unroll 16
+  for (int i = 0; i < COOKIE_MAP_BLOCK; i++) {
+    cookie[filled] = characters[i];
+    filled += (mask >> i) & 1;
+  }
+#else
+  for (int i = 0; i < COOKIE_MAP_BLOCK; i++) {
+    uint8_t byte = bytes[i];
+    cookie[filled] = (char)(MIN_COOKIE_CHAR + byte % COOKIE_CHARSET_SIZE);
+    filled += byte < COOKIE_BYTE_LIMIT;
+  }
+#endif
+  return filled;
+}
+
+class CookieGenerator {
+public:
+  void generate(char *cookie) {
+    char characters[COOKIE_SIZE + COOKIE_MAP_BLOCK];
+    size_t filled = 0;
+    while (filled < COOKIE_SIZE) {
+      if (position == COOKIE_ENTROPY_SIZE) {
+        refill();
+      }
+      filled = map_cookie_block((const uint8_t *)entropy + position,
+                                characters, filled);
+      position += COOKIE_MAP_BLOCK;
+    }
+    memcpy(cookie, characters, COOKIE_SIZE);
+  }
+
+private:
+  void refill() {
+    size_t filled = 0;
+    while (filled < COOKIE_ENTROPY_SIZE) {
+      ssize_t result = getrandom(entropy + filled, COOKIE_ENTROPY_SIZE - filled, 0);
+      if (result < 0) {
+        ENSURE(errno == EINTR);
+        continue;
+      }
+      filled += result;
+    }
+    position = 0;
+  }
+
+  char entropy[COOKIE_ENTROPY_SIZE]{};
+  size_t position{COOKIE_ENTROPY_SIZE};
+};
+
+// HMAC-SHA256 keyed with a secret drawn at startup. In the hmac cookie mode
+// a cookie is derived from the reservation itself, so it is recomputed for
+// every GET_TICKETS instead of being stored.
+class CookieSigner {
+public:
+  CookieSigner() {
+    uint8_t random_secret[COOKIE_SECRET_SIZE];
+    ENSURE(getrandom(random_secret, sizeof(random_secret), 0) ==
+           (ssize_t)sizeof(random_secret));
+    set_secret(random_secret);
+  }
+
+  [[nodiscard]] const uint8_t *get_secret() const { return secret; }
+
+  // The inner and outer key blocks are hashed once here, so signing a
+  // message costs two compressions per 32 bytes of output.
+  void set_secret(const uint8_t *new_secret) {
+    memcpy(secret, new_secret, COOKIE_SECRET_SIZE);
+    uint8_t inner_block[SHA256_BLOCK_SIZE];
+    uint8_t outer_block[SHA256_BLOCK_SIZE];
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) {
+      uint8_t key_byte = i < COOKIE_SECRET_SIZE ? secret[i] : 0;
+      inner_block[i] = key_byte ^ 0x36;
+      outer_block[i] = key_byte ^ 0x5c;
+    }
+    memcpy(inner_state, initial_state, sizeof(inner_state));
+    memcpy(outer_state, initial_state, sizeof(outer_state));
+    compress(inner_state, inner_block);
+    compress(outer_state, outer_block);
+  }
+
+  // Cookie characters are taken from HMAC(reservation_id, event_id,
+  // expiration_time, counter) for counter = 0, 1, ... with the same
+  // mapping as CookieGenerator. Characters past COOKIE_SIZE are dropped,
+  // so a cookie does not depend on how many bytes are mapped at once.
+  void sign(uint32_t reservation_id, uint32_t event_id,
+            uint64_t expiration_time, char *cookie) const {
+    uint8_t message[17];
+    reservation_id = htobe32(reservation_id);
+    event_id = htobe32(event_id);
+    expiration_time = htobe64(expiration_time);
+    memcpy(message, &reservation_id, 4);
+    memcpy(message + 4, &event_id, 4);
+    memcpy(message + 8, &expiration_time, 8);
+
+    char characters[COOKIE_SIZE + SHA256_DIGEST_SIZE];
+    size_t filled = 0;
+    for (uint8_t counter = 0; filled < COOKIE_SIZE; counter++) {
+      message[16] = counter;
+      uint8_t digest[SHA256_DIGEST_SIZE];
+      hmac(message, sizeof(message), digest);
+      for (int i = 0; i < SHA256_DIGEST_SIZE; i += COOKIE_MAP_BLOCK) {
+        filled = map_cookie_block(digest + i, characters, filled);
+      }
+    }
+    memcpy(cookie, characters, COOKIE_SIZE);
+  }
+
+  // Compares without an early exit, so the time taken does not reveal how
+  // many leading characters of a guess were right.
+  static bool equal(const char *first, const char *second) {
+    unsigned char difference = 0;
+    for (int i = 0; i < COOKIE_SIZE; i++) {
+      difference |= (unsigned char)(first[i] ^ second[i]);
+    }
+    return difference == 0;
+  }
+
+private:
+  // Messages are shorter than 56 bytes, so each hash is a single block.
+  void hmac(const uint8_t *message, size_t length, uint8_t *digest) const {
+    uint8_t block[SHA256_BLOCK_SIZE]{};
+    uint32_t state[8];
+
+    memcpy(state, inner_state, sizeof(state));
+    memcpy(block, message, length);
+    finish_block(block, length, SHA256_BLOCK_SIZE + length);
+    compress(state, block);
+    write_digest(state, block);
+
+    memset(block + SHA256_DIGEST_SIZE, 0,
+           SHA256_BLOCK_SIZE - SHA256_DIGEST_SIZE);
+    memcpy(state, outer_state, sizeof(state));
+    finish_block(block, SHA256_DIGEST_SIZE,
+                 SHA256_BLOCK_SIZE + SHA256_DIGEST_SIZE);
+    compress(state, block);
+    write_digest(state, digest);
+  }
+
+  static void finish_block(uint8_t *block, size_t length,
+                           uint64_t total_length) {
+    block[length] = 0x80;
+    uint64_t bits = htobe64(total_length * 8);
+    memcpy(block + SHA256_BLOCK_SIZE - 8, &bits, 8);
+  }
+
+  static void write_digest(const uint32_t *state, uint8_t *digest) {
+    for (int i = 0; i < 8; i++) {
+      uint32_t word = htobe32(state[i]);
+      memcpy(digest + 4 * i, &word, 4);
+    }
+  }
+
+  static uint32_t rotate(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+  static void compress(uint32_t *state, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      uint32_t word;
+      memcpy(&word, block + 4 * i, 4);
+      w[i] = be32toh(word);
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
 
-  event(string description, uint8_t descriptionLength,
-        uint16_t ticketsAvailable)
-      : description(std::move(description)),
-        description_length(descriptionLength),
-        tickets_available(ticketsAvailable) {}
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t s1 = rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25);
+      uint32_t choice = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + choice + round_constants[i] + w[i];
+      uint32_t s0 = rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22);
+      uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + majority;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+
+  static constexpr uint32_t initial_state[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+  static constexpr uint32_t round_constants[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+      0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+      0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+      0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+      0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+      0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+  uint8_t secret[COOKIE_SECRET_SIZE]{};
+  uint32_t inner_state[8]{};
+  uint32_t outer_state[8]{};
+};
+
+#define TICKET_DIGIT_PAIRS (TICKET_CHARSET_SIZE * TICKET_CHARSET_SIZE)
+
+// Every pair of ticket code digits, built at compile time
+struct ticket_digit_table {
+  char pairs[TICKET_DIGIT_PAIRS][2]{};
+
+  constexpr ticket_digit_table() {
+    for (size_t i = 0; i < TICKET_DIGIT_PAIRS; i++) {
+      pairs[i][0] = ticket_charset[i / TICKET_CHARSET_SIZE];
+      pairs[i][1] = ticket_charset[i % TICKET_CHARSET_SIZE];
+    }
+  }
 };
 
+static constexpr ticket_digit_table ticket_digits{};
+
 struct reservation {
   uint32_t event_id;
   uint16_t ticket_count;
   time_t expiration_time;
-  string cookie;
   bool achieved{false};
-  std::vector<string> tickets;
-  inline static size_t ticket_current_id;
-  inline static size_t reservation_current_id;
+  // Tickets of a reservation are always the consecutive ids
+  // first_ticket_id, ..., first_ticket_id + ticket_count - 1
+  size_t first_ticket_id{0};
+  inline static std::atomic<size_t> ticket_current_id;
+  inline static std::atomic<size_t> reservation_current_id;
+  inline static thread_local CookieGenerator cookie_generator;
+
+  reservation() = default;
 
   reservation(uint32_t eventId, uint16_t ticketCount, time_t expirationTime)
       : event_id(eventId), ticket_count(ticketCount),
-        expiration_time(expirationTime), cookie(std::move(generate_cookie())) {}
+        expiration_time(expirationTime) {}
 
   static void initialize_ids() {
     reservation::ticket_current_id = 0;
-    reservation::reservation_current_id = 1000000;
+    reservation::reservation_current_id = FIRST_RESERVATION_ID;
   }
 
   static size_t new_reservation_id() { return reservation_current_id++; }
 
-  static size_t new_ticket_id() { return ticket_current_id++; }
+  static size_t new_ticket_ids(size_t count) {
+    return ticket_current_id.fetch_add(count);
+  }
 
-  void generate_ticket() {
-    size_t ticket_id = new_ticket_id();
-    string ticket(TICKET_OCTETS, 'A');
-    size_t charset_size = strlen(ticket_charset);
+  void generate_tickets() { first_ticket_id = new_ticket_ids(ticket_count); }
 
-    for (int i = TICKET_OCTETS - 1; i >= 0; i--) {
-      ticket[i] = (ticket_charset[ticket_id % charset_size]);
-      ticket_id /= (int)charset_size;
+  // A ticket code is the ticket id written with TICKET_OCTETS base 36
+  // digits, two digits per division.
+  static void write_ticket(size_t ticket_id, char *destination) {
+    int i = TICKET_OCTETS;
+    for (; i >= 2; i -= 2) {
+      memcpy(destination + i - 2,
+             ticket_digits.pairs[ticket_id % TICKET_DIGIT_PAIRS], 2);
+      ticket_id /= TICKET_DIGIT_PAIRS;
+    }
+    if (i == 1) {
+      destination[0] = ticket_charset[ticket_id % TICKET_CHARSET_SIZE];
     }
-    tickets.push_back(ticket);
   }
 
-  static string generate_cookie() {
-    string cookie(COOKIE_SIZE, MIN_COOKIE_CHAR);
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dist(MIN_COOKIE_CHAR, MAX_COOKIE_CHAR);
-    for (int i = 0; i < COOKIE_SIZE; i++) {
-      cookie[i] = (char)dist(gen);
+  // Writes the codes of `count` consecutive tickets one after another.
+  // Tickets in a run of TICKET_DIGIT_PAIRS consecutive ids share all but
+  // their last two digits, so that prefix is computed once per run and each
+  // code is the prefix followed by a pair from the table.
+  static void write_tickets(size_t first_ticket_id, size_t count,
+                            char *destination) {
+    constexpr size_t prefix_size = TICKET_OCTETS - 2;
+    size_t written = 0;
+    while (written < count) {
+      size_t ticket_id = first_ticket_id + written;
+      size_t pair = ticket_id % TICKET_DIGIT_PAIRS;
+      size_t run = std::min(count - written, TICKET_DIGIT_PAIRS - pair);
+      char prefix[TICKET_OCTETS];
+      write_ticket(ticket_id, prefix);
+
+      char *ticket = destination + written * TICKET_OCTETS;
+      for (size_t i = 0; i < run; i++, ticket += TICKET_OCTETS) {
+        memcpy(ticket, prefix, prefix_size);
+        memcpy(ticket + prefix_size, ticket_digits.pairs[pair + i], 2);
+      }
+      written += run;
     }
-    return cookie;
+  }
+
+  static void generate_cookie(char *cookie) {
+    cookie_generator.generate(cookie);
   }
 };
 
@@ -150,12 +720,31 @@ private:
     WRONG_TIMEOUT = 4,
     WRONG_ARGS_NUMBER = 5,
     NO_FILE_PATH = 6,
+    WRONG_BATCH_SIZE = 7,
+    WRONG_IO_BACKEND = 8,
+    WRONG_WORKERS = 9,
+    WRONG_COOKIE_MODE = 10,
+    WRONG_ARCHIVE_PATH = 11,
+    WRONG_SNAPSHOT_PATH = 12,
+    WRONG_JOURNAL_PATH = 13,
+    WRONG_STATS_PATH = 14,
+    WRONG_LOG_PATH = 15,
+    WRONG_LISTEN_ADDRESSES = 16,
+    WRONG_DEDUP_WINDOW = 17,
+    WRONG_RATE_LIMITS = 18,
+    WRONG_SHED_THRESHOLD = 19,
+    WRONG_PRIORITY_BATCH_SIZE = 20,
+    WRONG_PORT_WITH_LISTEN_ADDRESSES = 21,
   };
 
 public:
   ServerParameters(int argc, char *argv[]) {
     port = DEFAULT_PORT;
     timeout = DEFAULT_TIMEOUT;
+    batch_size = DEFAULT_BATCH_SIZE;
+    io_backend = SOCKETS_BACKEND;
+    workers = DEFAULT_WORKERS;
+    cookie_mode = RANDOM_COOKIES;
     bin_file = argv[0];
     check_parameters(argc, argv);
   }
@@ -182,12 +771,67 @@ private:
     case NO_FILE_PATH:
       message = "FILEPATH NOT FOUND";
       break;
+    case WRONG_BATCH_SIZE:
+      message = "WRONG BATCH SIZE PARAMETER";
+      break;
+    case WRONG_IO_BACKEND:
+      message = "WRONG IO BACKEND PARAMETER (EXPECTED sockets OR uring)";
+      break;
+    case WRONG_WORKERS:
+      message = "WRONG WORKERS NUMBER PARAMETER";
+      break;
+    case WRONG_COOKIE_MODE:
+      message = "WRONG COOKIE MODE PARAMETER (EXPECTED random OR hmac)";
+      break;
+    case WRONG_ARCHIVE_PATH:
+      message = "WRONG PATH TO ARCHIVE PARAMETER";
+      break;
+    case WRONG_SNAPSHOT_PATH:
+      message = "WRONG PATH TO SNAPSHOT PARAMETER";
+      break;
+    case WRONG_JOURNAL_PATH:
+      message = "WRONG PATH TO JOURNAL PARAMETER";
+      break;
+    case WRONG_STATS_PATH:
+      message = "WRONG PATH TO STATISTICS PARAMETER";
+      break;
+    case WRONG_LOG_PATH:
+      message = "WRONG PATH TO LOG PARAMETER";
+      break;
+    case WRONG_LISTEN_ADDRESSES:
+      message =
+          "WRONG LISTEN ADDRESSES PARAMETER (EXPECTED [address:]port,...)";
+      break;
+    case WRONG_DEDUP_WINDOW:
+      message = "WRONG DEDUPLICATION WINDOW PARAMETER";
+      break;
+    case WRONG_RATE_LIMITS:
+      message = "WRONG RATE LIMITS PARAMETER (EXPECTED <events>,<reservations>,"
+                "<tickets> PER SECOND)";
+      break;
+    case WRONG_SHED_THRESHOLD:
+      message = "WRONG SHED THRESHOLD PARAMETER";
+      break;
+    case WRONG_PRIORITY_BATCH_SIZE:
+      message = "PRIORITY MODE NEEDS A BATCH SIZE GREATER THAN 1";
+      break;
+    case WRONG_PORT_WITH_LISTEN_ADDRESSES:
+      message = "-p CANNOT BE COMBINED WITH -L (GIVE THE PORTS IN -L)";
+      break;
     default:
       message = "WRONG PARAMETERS";
     }
     message.append("\n");
     fprintf(stderr,
-            "Usage: %s -f <path to events file> [-p <port>] [-t <timeout>]\n",
+            "Usage: %s -f <path to events file> [-p <port>] [-t <timeout>] "
+            "[-b <batch size>] [-i <sockets|uring>] [-w <workers>] "
+            "[-c <random|hmac>] [-a <path to archive file>] "
+            "[-s <path to snapshot file>] [-j <path to journal file>] "
+            "[-m <path to statistics file>] [-l <path to log file>] "
+            "[-L <[address:]port,...>] [-d <deduplication window>] "
+            "[-r <events>,<reservations>,<tickets> per second] "
+            "[-P <shed threshold>]\n"
+            "-L replaces -p, so the two cannot be given together\n",
             bin_file);
     fprintf(stderr, "%s", message.c_str());
     exit(1);
@@ -201,6 +845,88 @@ private:
     file_path = path;
   }
 
+  // The archive is created if needed; it only has to be writable.
+  void check_archive_path(char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      exit_program(WRONG_ARCHIVE_PATH);
+    }
+    close(fd);
+    archive_path = path;
+  }
+
+  // A missing snapshot is created on the first SIGUSR1 or SIGTERM.
+  void check_snapshot_path(char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      exit_program(WRONG_SNAPSHOT_PATH);
+    }
+    close(fd);
+    snapshot_path = path;
+  }
+
+  void check_journal_path(char *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+      exit_program(WRONG_JOURNAL_PATH);
+    }
+    close(fd);
+    journal_path = path;
+  }
+
+  // The statistics file is replaced as a whole, so its directory has to
+  // be writable rather than the file itself.
+  void check_stats_path(char *path) {
+    string directory = path;
+    size_t slash = directory.rfind('/');
+    directory = slash == string::npos ? "." : directory.substr(0, slash + 1);
+    if (access(directory.c_str(), W_OK) != 0) {
+      exit_program(WRONG_STATS_PATH);
+    }
+    stats_path = path;
+  }
+
+  // The log is appended to
+  void check_log_path(char *path) {
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+      exit_program(WRONG_LOG_PATH);
+    }
+    close(fd);
+    log_path = path;
+  }
+
+  // Comma separated [address:]port entries; an entry without an address
+  // listens on all of them. They replace the default of -p on all addresses.
+  void check_listen_addresses(char *list) {
+    string entries = list;
+    size_t begin = 0;
+    while (begin <= entries.size()) {
+      size_t end = std::min(entries.find(',', begin), entries.size());
+      string entry = entries.substr(begin, end - begin);
+      struct sockaddr_in address {};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_ANY);
+      size_t colon = entry.rfind(':');
+      if (colon != string::npos) {
+        if (inet_pton(AF_INET, entry.substr(0, colon).c_str(),
+                      &address.sin_addr) != 1) {
+          exit_program(WRONG_LISTEN_ADDRESSES);
+        }
+        entry = entry.substr(colon + 1);
+      }
+      if (entry.empty() || entry.size() > 5 ||
+          std::any_of(entry.begin(), entry.end(),
+                      [](char c) { return !isdigit(c); }) ||
+          strtoul(entry.c_str(), nullptr, 10) > UINT16_MAX) {
+        exit_program(WRONG_LISTEN_ADDRESSES);
+      }
+      address.sin_port = htons((uint16_t)strtoul(entry.c_str(), nullptr, 10));
+      listen_addresses.push_back(address);
+      begin = end + 1;
+    }
+  }
+
   int check_port(char *port_str) {
     port = (int)strtoul(port_str, nullptr, 10);
     if (port < 0 || port > UINT16_MAX ||
@@ -220,13 +946,97 @@ private:
     return timeout;
   }
 
+  int check_dedup_window(char *dedup_window_str) {
+    dedup_window = (int)strtoul(dedup_window_str, nullptr, 10);
+    if (dedup_window < 1 || dedup_window > 86400 ||
+        std::any_of(dedup_window_str,
+                    dedup_window_str + strlen(dedup_window_str),
+                    [](char c) { return !isdigit(c); })) {
+      exit_program(WRONG_DEDUP_WINDOW);
+    }
+    return dedup_window;
+  }
+
+  int check_shed_threshold(char *shed_threshold_str) {
+    shed_threshold = (int)strtoul(shed_threshold_str, nullptr, 10);
+    if (shed_threshold < 1 || shed_threshold > MAX_BATCH_SIZE ||
+        std::any_of(shed_threshold_str,
+                    shed_threshold_str + strlen(shed_threshold_str),
+                    [](char c) { return !isdigit(c); })) {
+      exit_program(WRONG_SHED_THRESHOLD);
+    }
+    return shed_threshold;
+  }
+
+  // Limits of GET_EVENTS, GET_RESERVATION and GET_TICKETS per client
+  // address and second, 0 for no limit
+  void check_rate_limits(char *rate_limits_str) {
+    string limits = rate_limits_str;
+    size_t begin = 0;
+    for (size_t i = 0; i < REQUEST_TYPES; i++) {
+      size_t end = std::min(limits.find(',', begin), limits.size());
+      string limit = limits.substr(begin, end - begin);
+      if (limit.empty() || limit.size() > 7 ||
+          std::any_of(limit.begin(), limit.end(),
+                      [](char c) { return !isdigit(c); }) ||
+          strtoul(limit.c_str(), nullptr, 10) > MAX_RATE_LIMIT ||
+          (i + 1 < REQUEST_TYPES) != (end < limits.size())) {
+        exit_program(WRONG_RATE_LIMITS);
+      }
+      rate_limits[i] = (uint32_t)strtoul(limit.c_str(), nullptr, 10);
+      begin = end + 1;
+    }
+  }
+
+  int check_batch_size(char *batch_size_str) {
+    batch_size = (int)strtoul(batch_size_str, nullptr, 10);
+    if (batch_size < 1 || batch_size > MAX_BATCH_SIZE ||
+        std::any_of(batch_size_str, batch_size_str + strlen(batch_size_str),
+                    [](char c) { return !isdigit(c); })) {
+      exit_program(WRONG_BATCH_SIZE);
+    }
+    return batch_size;
+  }
+
+  int check_workers(char *workers_str) {
+    workers = (int)strtoul(workers_str, nullptr, 10);
+    if (workers < 1 || workers > MAX_WORKERS ||
+        std::any_of(workers_str, workers_str + strlen(workers_str),
+                    [](char c) { return !isdigit(c); })) {
+      exit_program(WRONG_WORKERS);
+    }
+    return workers;
+  }
+
+  COOKIE_MODE check_cookie_mode(char *cookie_mode_str) {
+    if (strcmp(cookie_mode_str, "random") == 0) {
+      return RANDOM_COOKIES;
+    }
+    if (strcmp(cookie_mode_str, "hmac") == 0) {
+      return HMAC_COOKIES;
+    }
+    exit_program(WRONG_COOKIE_MODE);
+    return RANDOM_COOKIES;
+  }
+
+  IO_BACKEND check_io_backend(char *io_backend_str) {
+    if (strcmp(io_backend_str, "sockets") == 0) {
+      return SOCKETS_BACKEND;
+    }
+    if (strcmp(io_backend_str, "uring") == 0) {
+      return URING_BACKEND;
+    }
+    exit_program(WRONG_IO_BACKEND);
+    return SOCKETS_BACKEND;
+  }
+
   void check_parameters(int argc, char *argv[]) {
-    if ((argc < 3 || argc > 7) || argc % 2 == 0)
+    if ((argc < 3 || argc > 33) || argc % 2 == 0)
       exit_program(WRONG_ARGS_NUMBER);
 
     bool flag_file_occurred = false;
 
-    const char *flags = "-f:p:t:";
+    const char *flags = "-f:p:t:b:i:w:c:a:s:j:m:l:L:d:r:P:";
     int opt;
     while ((opt = getopt(argc, argv, flags)) != -1)
       switch (opt) {
@@ -236,15 +1046,76 @@ private:
         break;
       case 'p':
         port = check_port(optarg);
+        port_given = true;
         break;
       case 't':
         timeout = check_timeout(optarg);
         break;
+      case 'b':
+        batch_size = check_batch_size(optarg);
+        batch_size_given = true;
+        break;
+      case 'i':
+        io_backend = check_io_backend(optarg);
+        break;
+      case 'w':
+        workers = check_workers(optarg);
+        break;
+      case 'c':
+        cookie_mode = check_cookie_mode(optarg);
+        break;
+      case 'a':
+        check_archive_path(optarg);
+        break;
+      case 's':
+        check_snapshot_path(optarg);
+        break;
+      case 'j':
+        check_journal_path(optarg);
+        break;
+      case 'm':
+        check_stats_path(optarg);
+        break;
+      case 'l':
+        check_log_path(optarg);
+        break;
+      case 'L':
+        listen_addresses.clear();
+        check_listen_addresses(optarg);
+        listen_addresses_given = true;
+        break;
+      case 'd':
+        dedup_window = check_dedup_window(optarg);
+        break;
+      case 'r':
+        check_rate_limits(optarg);
+        break;
+      case 'P':
+        shed_threshold = check_shed_threshold(optarg);
+        break;
       default:
         exit_program(NO_FILE_PATH);
       }
     if (!flag_file_occurred)
       exit_program(WRONG_FLAGS);
+    // The priority mode reorders batches, so it always reads them
+    if (shed_threshold > 0 && batch_size == 1) {
+      if (batch_size_given) {
+        exit_program(WRONG_PRIORITY_BATCH_SIZE);
+      }
+      batch_size = PRIORITY_BATCH_SIZE;
+    }
+    // -L lists every port to bind, so a -p next to it would go unused
+    if (port_given && listen_addresses_given) {
+      exit_program(WRONG_PORT_WITH_LISTEN_ADDRESSES);
+    }
+    if (listen_addresses.empty()) {
+      struct sockaddr_in address {};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_ANY);
+      address.sin_port = htons(port);
+      listen_addresses.push_back(address);
+    }
   }
 
 public:
@@ -254,236 +1125,1796 @@ public:
 
   [[nodiscard]] int get_timeout() const { return timeout; }
 
-private:
-  int port;
-  int timeout;
-  char *bin_file;
-  char *file_path{};
-};
+  [[nodiscard]] int get_batch_size() const { return batch_size; }
 
-// Class for server data: events, reservations, etc.
-class Data {
+  // Seconds for which a repeated GET_RESERVATION gets the same reply, 0
+  // when every GET_RESERVATION makes a new reservation
+  [[nodiscard]] int get_dedup_window() const { return dedup_window; }
 
-public:
-  explicit Data(const ServerParameters &parameters) : parameters(parameters) {
-    reservation::initialize_ids();
-    parse_from_file();
+  // 0 unless batches are served in the priority mode
+  [[nodiscard]] int get_shed_threshold() const { return shed_threshold; }
+
+  // Requests per second allowed to one client address, by request type
+  [[nodiscard]] const std::array<uint32_t, REQUEST_TYPES> &
+  get_rate_limits() const {
+    return rate_limits;
   }
 
-private:
-  void parse_from_file() {
-    FILE *fp = fopen(parameters.get_file_path(), "r");
-    int event_id = 0;
-    char description[MAX_DESCRIPTION_SIZE + 2];
-    char tickets_str[MAX_DESCRIPTION_SIZE + 2];
+  [[nodiscard]] IO_BACKEND get_io_backend() const { return io_backend; }
 
-    while (fgets(description, MAX_DESCRIPTION_SIZE + 2, fp) &&
-           fgets(tickets_str, MAX_DESCRIPTION_SIZE + 2, fp)) {
+  [[nodiscard]] int get_workers() const { return workers; }
 
-      int description_length = (int)strlen(description) - 1;
-      string description_str = string(description, description_length);
-      event new_event = event(description_str, description_length,
-                              strtoul(tickets_str, nullptr, 10));
-      events_map.insert({event_id, new_event});
-      event_id++;
-    }
+  [[nodiscard]] COOKIE_MODE get_cookie_mode() const { return cookie_mode; }
 
-    fclose(fp);
-  }
+  // nullptr when achieved reservations are kept in memory
+  [[nodiscard]] char *get_archive_path() const { return archive_path; }
 
-public:
-  void remove_expired_reservations(time_t &current_time) {
-    std::vector<int> reservations_to_remove;
-    for (const auto &element : reservations_map) {
-      int r_id = element.first;
-      reservation const &r = element.second;
-      if (!r.achieved && (r.expiration_time < current_time)) {
-        reservations_to_remove.push_back(r_id);
-      }
-    }
-    for (auto &r_id : reservations_to_remove) {
-      reservation &r = reservations_map.at(r_id);
-      events_map.at((int)r.event_id).tickets_available += r.ticket_count;
-      reservations_map.erase(r_id);
-    }
-  }
+  // nullptr when the state is not saved between runs
+  [[nodiscard]] char *get_snapshot_path() const { return snapshot_path; }
 
-  bool validate_tickets(int reservation_id, string &expected_cookie,
-                        time_t current_time) {
-    if (reservations_map.find(reservation_id) == reservations_map.end())
-      return false;
-    reservation &r = reservations_map.at(reservation_id);
-    return !((r.cookie != expected_cookie) ||
-             (!r.achieved && (r.expiration_time < current_time)));
-  }
+  // nullptr when reservation changes are not logged
+  [[nodiscard]] char *get_journal_path() const { return journal_path; }
 
-  bool validate_reservation(int event_id, int ticket_count) {
-    return !((ticket_count == 0) ||
-             (events_map.find(event_id) == events_map.end()) ||
-             (events_map.at(event_id).tickets_available < ticket_count) ||
-             ((TICKET_OCTETS + ticket_count * TICKET_OCTETS) > BUFFER_SIZE));
-  }
+  // nullptr when the statistics are not written out
+  [[nodiscard]] char *get_stats_path() const { return stats_path; }
 
-  [[nodiscard]] eventMap &get_events_map() { return events_map; }
+  // nullptr when requests are logged only in debug builds, to stderr
+  [[nodiscard]] char *get_log_path() const { return log_path; }
 
-  reservationMap &getReservationsMap() { return reservations_map; }
+  // Never empty: all addresses on the -p port unless -L was given
+  [[nodiscard]] const std::vector<struct sockaddr_in> &
+  get_listen_addresses() const {
+    return listen_addresses;
+  }
 
 private:
-  ServerParameters parameters;
-  eventMap events_map;
-  reservationMap reservations_map;
+  int port;
+  int timeout;
+  int batch_size;
+  bool batch_size_given{false};
+  bool port_given{false};
+  bool listen_addresses_given{false};
+  int dedup_window{0};
+  std::array<uint32_t, REQUEST_TYPES> rate_limits{};
+  int shed_threshold{0};
+  IO_BACKEND io_backend;
+  int workers;
+  COOKIE_MODE cookie_mode;
+  char *bin_file;
+  char *file_path{};
+  char *archive_path{};
+  char *snapshot_path{};
+  char *journal_path{};
+  char *stats_path{};
+  char *log_path{};
+  std::vector<struct sockaddr_in> listen_addresses;
 };
 
-// Class for operations on buffer, mostly converting data to proper format
-class Buffer {
+// Reservations of one shard, kept in a pool of slots. A freed slot goes to
+// a free list and is the next one taken, so memory follows the number of
+// reservations kept, not the range of their ids. An open addressing index
+// maps ids to slots. Reservation ids are handed out sequentially, so the
+// k-th id of the shard starts probing at entry k mod capacity and
+// neighbouring ids take neighbouring entries. The id kept in a slot is its
+// generation: a stale id whose slot was reused no longer matches it. The
+// pool and the index only ever double, so in a steady state nothing is
+// allocated.
+class ReservationTable {
+public:
+  // Ids of this table are first + stride * k for k = 0, 1, ...
+  void initialize(size_t stride, bool store_cookies) {
+    id_stride = stride;
+    cookies_stored = store_cookies;
+    slots.reserve(INITIAL_TABLE_CAPACITY);
+    cookies.reserve(cookies_stored ? INITIAL_TABLE_CAPACITY : 0);
+    free_slots.reserve(INITIAL_TABLE_CAPACITY);
+    resize_index(2 * INITIAL_TABLE_CAPACITY);
+  }
 
-private:
-  template <typename T> T convert_to_send(T number) {
-    switch (sizeof(T)) {
-    case 1:
-      return number;
-    case 2:
-      return htobe16(number);
-    case 4:
-      return htobe32(number);
-    default:
-      return htobe64(number);
+  reservation *find(int reservation_id) {
+    if (reservation_id < FIRST_RESERVATION_ID) {
+      return nullptr;
     }
+    size_t position = index_position((uint32_t)reservation_id);
+    return index[position].id != 0 ? &slots[index[position].slot].r : nullptr;
   }
 
-  template <typename T> T convert_to_receive(T number) {
-    switch (sizeof(T)) {
-    case 1:
-      return number;
-    case 2:
-      return be16toh(number);
-    case 4:
-      return be32toh(number);
-    default:
-      return be64toh(number);
+  void insert(int reservation_id, const reservation &r, const char *cookie) {
+    if (2 * (kept + 1) > index.size()) {
+      resize_index(2 * index.size());
+    }
+    uint32_t slot_index;
+    if (free_slots.empty()) {
+      slot_index = (uint32_t)slots.size();
+      slots.emplace_back();
+      if (cookies_stored) {
+        cookies.emplace_back();
+      }
+    } else {
+      slot_index = free_slots.back();
+      free_slots.pop_back();
+    }
+    table_slot &slot = slots[slot_index];
+    slot.id = (uint32_t)reservation_id;
+    slot.r = r;
+    index[index_position(slot.id)] = {slot.id, slot_index};
+    kept++;
+    if (cookies_stored) {
+      memcpy(cookies[slot_index].data(), cookie, COOKIE_SIZE);
+    }
+    if (!r.achieved) {
+      expiry_heap.push_back({r.expiration_time, slot_index});
+      slot.expiry_position = (uint32_t)expiry_heap.size() - 1;
+      sift_up(expiry_heap.size() - 1);
     }
   }
 
-  template <typename T> void insert(T number) {
-    int size = sizeof(T);
-    number = convert_to_send(number);
-    memcpy(buffer + send_index, &number, size);
-    send_index += size;
+  // Calls visit(reservation_id, reservation, cookie) for every reservation
+  // kept; the cookie is nullptr when cookies are not stored.
+  template <typename F> void for_each(F visit) {
+    for (size_t i = 0; i < slots.size(); i++) {
+      if (slots[i].id != 0) {
+        visit((int)slots[i].id, slots[i].r,
+              cookies_stored ? cookies[i].data() : nullptr);
+      }
+    }
   }
 
-  void insert(const string &str) {
-    size_t size = str.size();
-    memcpy(buffer + send_index, str.c_str(), size);
-    send_index += size;
+  // The reservation must be kept in the table
+  char *get_cookie(int reservation_id) {
+    return cookies[slot_of(reservation_id)].data();
   }
 
-  template <typename T> void receive_number(T &number) {
-    int size = sizeof(T);
-    memcpy(&number, buffer + read_index, size);
-    read_index += size;
-    number = convert_to_receive(number);
+  // Achieved reservations never expire, so they leave the heap right away.
+  void achieve(int reservation_id) {
+    table_slot &slot = slots[slot_of(reservation_id)];
+    slot.r.achieved = true;
+    remove_from_heap(slot.expiry_position);
   }
 
-  string receive_cookie() { return {buffer + read_index, COOKIE_SIZE}; }
-
-  void insert_single_event(const event &e, int event_id) {
-    insert(event_id);
-    insert(e.tickets_available);
-    insert(e.description_length);
-    insert(e.description);
+  // Frees the slot of a reservation, whether it waits for its tickets or not.
+  void erase(int reservation_id) {
+    uint32_t slot_index = slot_of(reservation_id);
+    if (!slots[slot_index].r.achieved) {
+      remove_from_heap(slots[slot_index].expiry_position);
+    }
+    free_slot(slot_index);
   }
 
-  void insert_tickets(int reservation_id, const reservation &r) {
-    reset_send_index();
-
-    insert(TICKETS);
-    insert(reservation_id);
-    insert(r.ticket_count);
-    for (const string &ticket : r.tickets) {
-      insert(ticket);
+  // Calls release for every reservation that expired before current_time
+  // and frees its slot; only the reservations that are due are visited.
+  template <typename F> void remove_expired(time_t current_time, F release) {
+    while (!expiry_heap.empty() &&
+           expiry_heap[0].expiration_time < current_time) {
+      uint32_t slot_index = expiry_heap[0].index;
+      release((int)slots[slot_index].id, slots[slot_index].r);
+      remove_from_heap(0);
+      free_slot(slot_index);
     }
   }
 
-  void insert_reservation(int reservation_id, reservation &r) {
-    reset_send_index();
-
-    insert(RESERVATION);
-    insert(reservation_id);
-    insert(r.event_id);
-    insert(r.ticket_count);
-    insert(r.cookie);
-    insert(r.expiration_time);
-  }
+  [[nodiscard]] size_t size() const { return kept; }
 
-  void insert_bad_request(int id) {
-    reset_send_index();
+  // Reservations still waiting for their tickets
+  [[nodiscard]] size_t pending() const { return expiry_heap.size(); }
 
-    insert(BAD_REQUEST);
-    insert(id);
+  // 0 when no reservation waits for its tickets
+  [[nodiscard]] time_t next_expiration() const {
+    return expiry_heap.empty() ? 0 : expiry_heap[0].expiration_time;
   }
 
-  // we begin from 1, because we already know the value of buffer[0]- message_id
-  void reset_read_index() { read_index = 1; }
+private:
+  struct table_slot {
+    uint32_t id{0};
+    uint32_t expiry_position{0};
+    reservation r;
+  };
 
-  void reset_send_index() { send_index = 0; }
+  // id 0 marks an unused entry
+  struct index_entry {
+    uint32_t id{0};
+    uint32_t slot{0};
+  };
 
-public:
-  void insert_events(Data &data) {
-    reset_send_index();
+  struct expiry_entry {
+    time_t expiration_time;
+    uint32_t index;
+  };
 
-    insert(EVENTS);
-    for (auto &element : data.get_events_map()) {
-      int event_id = element.first;
-      event const &eve = element.second;
-      int eve_size = eve.description_length + EVENT_CONST_OCTETS;
+  [[nodiscard]] size_t home_of(uint32_t reservation_id) const {
+    return (((size_t)reservation_id - FIRST_RESERVATION_ID) / id_stride) &
+           index_mask;
+  }
 
-      if (send_index + eve_size > BUFFER_SIZE) {
+  // The entry of the id, or the unused entry where it would go
+  [[nodiscard]] size_t index_position(uint32_t reservation_id) const {
+    size_t position = home_of(reservation_id);
+    while (index[position].id != 0 && index[position].id != reservation_id) {
+      position = (position + 1) & index_mask;
+    }
+    return position;
+  }
+
+  [[nodiscard]] uint32_t slot_of(int reservation_id) const {
+    return index[index_position((uint32_t)reservation_id)].slot;
+  }
+
+  // Removes the id from the index by shifting back the entries that probed
+  // past it, so lookups never need tombstones
+  void free_slot(uint32_t slot_index) {
+    size_t hole = index_position(slots[slot_index].id);
+    size_t position = hole;
+    while (true) {
+      position = (position + 1) & index_mask;
+      if (index[position].id == 0) {
         break;
-      } else {
-        insert_single_event(eve, event_id);
+      }
+      size_t home = home_of(index[position].id);
+      if (((position - home) & index_mask) >=
+          ((position - hole) & index_mask)) {
+        index[hole] = index[position];
+        hole = position;
+      }
+    }
+    index[hole] = {};
+    slots[slot_index].id = 0;
+    free_slots.push_back(slot_index);
+    kept--;
+  }
+
+  void resize_index(size_t capacity) {
+    index.assign(capacity, {});
+    index_mask = capacity - 1;
+    for (uint32_t i = 0; i < (uint32_t)slots.size(); i++) {
+      if (slots[i].id != 0) {
+        index[index_position(slots[i].id)] = {slots[i].id, i};
+      }
+    }
+  }
+
+  void swap_in_heap(size_t first, size_t second) {
+    std::swap(expiry_heap[first], expiry_heap[second]);
+    slots[expiry_heap[first].index].expiry_position = (uint32_t)first;
+    slots[expiry_heap[second].index].expiry_position = (uint32_t)second;
+  }
+
+  void sift_up(size_t position) {
+    while (position > 0) {
+      size_t parent = (position - 1) / 2;
+      if (expiry_heap[parent].expiration_time <=
+          expiry_heap[position].expiration_time) {
+        break;
+      }
+      swap_in_heap(parent, position);
+      position = parent;
+    }
+  }
+
+  void sift_down(size_t position) {
+    while (true) {
+      size_t smallest = position;
+      for (size_t child = 2 * position + 1;
+           child <= 2 * position + 2 && child < expiry_heap.size(); child++) {
+        if (expiry_heap[child].expiration_time <
+            expiry_heap[smallest].expiration_time) {
+          smallest = child;
+        }
+      }
+      if (smallest == position) {
+        return;
+      }
+      swap_in_heap(smallest, position);
+      position = smallest;
+    }
+  }
+
+  void remove_from_heap(size_t position) {
+    swap_in_heap(position, expiry_heap.size() - 1);
+    expiry_heap.pop_back();
+    if (position < expiry_heap.size()) {
+      sift_down(position);
+      sift_up(position);
+    }
+  }
+
+  std::vector<table_slot> slots;
+  std::vector<std::array<char, COOKIE_SIZE>> cookies;
+  std::vector<uint32_t> free_slots;
+  std::vector<index_entry> index;
+  std::vector<expiry_entry> expiry_heap;
+  size_t index_mask{0};
+  size_t id_stride{1};
+  size_t kept{0};
+  bool cookies_stored{false};
+};
+
+// Achieved reservations moved out of memory into a file of fixed-size records.
+// The record of reservation_id is at position reservation_id -
+// FIRST_RESERVATION_ID, so the file is sparse and the position is the index.
+// The file is mapped chunk by chunk as ids grow; once a newer chunk is in use,
+// the pages of the older ones are dropped from memory and come back from the
+// file only when an old reservation is asked for again.
+class ReservationArchive {
+public:
+  ReservationArchive() = default;
+  ReservationArchive(const ReservationArchive &) = delete;
+  ReservationArchive &operator=(const ReservationArchive &) = delete;
+
+  virtual ~ReservationArchive() {
+    if (chunks == nullptr) {
+      return;
+    }
+    for (size_t i = 0; i < ARCHIVE_MAX_CHUNKS; i++) {
+      if (chunks[i] != nullptr) {
+        munmap(chunks[i], CHUNK_BYTES);
+      }
+    }
+    close(fd);
+  }
+
+  void open_file(const char *path, bool truncate) {
+    fd = open(path, O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    ENSURE(fd >= 0);
+    struct stat file_stat {};
+    ENSURE(fstat(fd, &file_stat) == 0);
+    file_size = file_stat.st_size;
+    chunks = std::make_unique<std::atomic<archive_record *>[]>(
+        ARCHIVE_MAX_CHUNKS);
+    for (size_t i = 0; (off_t)((i + 1) * CHUNK_BYTES) <= file_size; i++) {
+      map_chunk(i);
+    }
+  }
+
+  [[nodiscard]] bool is_open() const { return fd >= 0; }
+
+  // Callers of store and find must hold the lock of the reservation's shard,
+  // so a record is never read and written at the same time.
+  void store(int reservation_id, const reservation &r, const char *cookie) {
+    size_t position = (size_t)reservation_id - FIRST_RESERVATION_ID;
+    archive_record &record =
+        map_chunk(position >> ARCHIVE_CHUNK_SHIFT)[position & CHUNK_MASK];
+    record.event_id = r.event_id;
+    record.ticket_count = r.ticket_count;
+    record.expiration_time = r.expiration_time;
+    record.first_ticket_id = r.first_ticket_id;
+    memcpy(record.cookie, cookie, COOKIE_SIZE);
+    record.reservation_id = (uint32_t)reservation_id;
+    stored.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Fills r with the archived reservation if it exists and the cookie is
+  // its; otherwise returns why not.
+  BAD_REQUEST_REASON find(int reservation_id, const char *cookie,
+                          reservation &r) {
+    if (reservation_id < FIRST_RESERVATION_ID) {
+      return UNKNOWN_RESERVATION;
+    }
+    size_t position = (size_t)reservation_id - FIRST_RESERVATION_ID;
+    archive_record *chunk = chunks[position >> ARCHIVE_CHUNK_SHIFT].load();
+    if (chunk == nullptr) {
+      return UNKNOWN_RESERVATION;
+    }
+    const archive_record &record = chunk[position & CHUNK_MASK];
+    if (record.reservation_id != (uint32_t)reservation_id) {
+      return UNKNOWN_RESERVATION;
+    }
+    if (!CookieSigner::equal(record.cookie, cookie)) {
+      return WRONG_COOKIE;
+    }
+    r = reservation(record.event_id, record.ticket_count,
+                    record.expiration_time);
+    r.achieved = true;
+    r.first_ticket_id = record.first_ticket_id;
+    return NOT_REFUSED;
+  }
+
+  // Records stored since the start, not counting those already in the file
+  [[nodiscard]] size_t get_stored() const {
+    return stored.load(std::memory_order_relaxed);
+  }
+
+private:
+  // reservation_id 0 marks a hole of the sparse file
+  struct archive_record {
+    uint32_t reservation_id;
+    uint32_t event_id;
+    uint64_t first_ticket_id;
+    int64_t expiration_time;
+    uint16_t ticket_count;
+    char cookie[COOKIE_SIZE];
+  };
+
+  static constexpr size_t CHUNK_RECORDS = (size_t)1 << ARCHIVE_CHUNK_SHIFT;
+  static constexpr size_t CHUNK_MASK = CHUNK_RECORDS - 1;
+  static constexpr size_t CHUNK_BYTES = CHUNK_RECORDS * sizeof(archive_record);
+
+  archive_record *map_chunk(size_t index) {
+    ENSURE(index < ARCHIVE_MAX_CHUNKS);
+    archive_record *chunk = chunks[index].load();
+    if (chunk != nullptr) {
+      return chunk;
+    }
+    std::lock_guard<std::mutex> lock(mapping_mutex);
+    chunk = chunks[index].load();
+    if (chunk != nullptr) {
+      return chunk;
+    }
+    off_t offset = (off_t)(index * CHUNK_BYTES);
+    if (file_size < offset + (off_t)CHUNK_BYTES) {
+      file_size = offset + (off_t)CHUNK_BYTES;
+      ENSURE(ftruncate(fd, file_size) == 0);
+    }
+    void *memory = mmap(nullptr, CHUNK_BYTES, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, offset);
+    ENSURE(memory != MAP_FAILED);
+    chunk = (archive_record *)memory;
+    chunks[index].store(chunk);
+    // Reservations live at most one timeout, so records of chunks two
+    // behind the newest one are rarely touched again
+    if (index >= 2 && chunks[index - 2].load() != nullptr) {
+      madvise(chunks[index - 2].load(), CHUNK_BYTES, MADV_DONTNEED);
+    }
+    return chunk;
+  }
+
+  int fd{-1};
+  off_t file_size{0};
+  std::unique_ptr<std::atomic<archive_record *>[]> chunks;
+  std::mutex mapping_mutex;
+  std::atomic<size_t> stored{0};
+};
+
+struct journal_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t cookie_mode;
+  // Cookies of journaled hmac reservations stay valid after a restart
+  uint8_t cookie_secret[COOKIE_SECRET_SIZE];
+};
+
+enum JOURNAL_RECORD_TYPE {
+  JOURNAL_CREATE = 1,
+  JOURNAL_EXPIRE = 2,
+  JOURNAL_ACHIEVE = 3,
+};
+
+struct journal_record {
+  uint8_t type;
+  uint16_t ticket_count;
+  uint32_t reservation_id;
+  uint32_t event_id;
+  int64_t expiration_time;
+  uint64_t first_ticket_id;
+  // Only for random cookies; hmac ones are derived from the rest
+  char cookie[COOKIE_SIZE];
+};
+
+// Append-only log of reservation changes. Each worker collects the records
+// of the requests it handles and commits them once per batch: they are
+// appended and synced before any reply of the batch is sent, so a client
+// never holds a reservation or tickets that a crash could take back.
+class Journal {
+public:
+  Journal() = default;
+  Journal(const Journal &) = delete;
+  Journal &operator=(const Journal &) = delete;
+
+  virtual ~Journal() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  // Returns the records kept in the file. Whatever follows the last
+  // complete record, e.g. a write torn by a crash, is cut off.
+  std::vector<journal_record> open_file(const char *path,
+                                        const journal_header &new_header) {
+    fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    ENSURE(fd >= 0);
+    std::vector<journal_record> records;
+    struct stat file_stat {};
+    ENSURE(fstat(fd, &file_stat) == 0);
+    auto size = (size_t)file_stat.st_size;
+    if (size < sizeof(journal_header)) {
+      start(new_header);
+      return records;
+    }
+
+    ENSURE(pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header));
+    ENSURE(memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0);
+    ENSURE(header.version == JOURNAL_VERSION);
+    ENSURE(header.cookie_mode == new_header.cookie_mode);
+    records.resize((size - sizeof(header)) / sizeof(journal_record));
+    size_t bytes = records.size() * sizeof(journal_record);
+    ENSURE(pread(fd, records.data(), bytes, sizeof(header)) == (ssize_t)bytes);
+    size_t valid = 0;
+    while (valid < records.size() && records[valid].type >= JOURNAL_CREATE &&
+           records[valid].type <= JOURNAL_ACHIEVE) {
+      valid++;
+    }
+    records.resize(valid);
+    ENSURE(ftruncate(fd, (off_t)(sizeof(header) +
+                                 valid * sizeof(journal_record))) == 0);
+    return records;
+  }
+
+  // Empties the journal, e.g. once a snapshot holds everything in it.
+  void start(const journal_header &new_header) {
+    header = new_header;
+    ENSURE(ftruncate(fd, 0) == 0);
+    ENSURE(write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header));
+    ENSURE(fdatasync(fd) == 0);
+  }
+
+  [[nodiscard]] bool is_open() const { return fd >= 0; }
+
+  [[nodiscard]] const journal_header &get_header() const { return header; }
+
+  void record_create(int reservation_id, const reservation &r,
+                     const char *cookie) {
+    if (!is_open()) {
+      return;
+    }
+    journal_record &record = append(JOURNAL_CREATE, reservation_id);
+    record.event_id = r.event_id;
+    record.ticket_count = r.ticket_count;
+    record.expiration_time = r.expiration_time;
+    memcpy(record.cookie, cookie, COOKIE_SIZE);
+  }
+
+  void record_expire(int reservation_id) {
+    if (is_open()) {
+      append(JOURNAL_EXPIRE, reservation_id);
+    }
+  }
+
+  void record_achieve(int reservation_id, const reservation &r) {
+    if (is_open()) {
+      append(JOURNAL_ACHIEVE, reservation_id).first_ticket_id =
+          r.first_ticket_id;
+    }
+  }
+
+  // Writes the records of the calling worker and waits until they are on
+  // disk. The sync is done outside the lock, so workers committing at the
+  // same time share the wait.
+  void commit() {
+    if (pending.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(append_mutex);
+      size_t bytes = pending.size() * sizeof(journal_record);
+      ENSURE(write(fd, pending.data(), bytes) == (ssize_t)bytes);
+    }
+    ENSURE(fdatasync(fd) == 0);
+    pending.clear();
+  }
+
+private:
+  journal_record &append(JOURNAL_RECORD_TYPE type, int reservation_id) {
+    journal_record &record = pending.emplace_back();
+    record = {};
+    record.type = (uint8_t)type;
+    record.reservation_id = (uint32_t)reservation_id;
+    return record;
+  }
+
+  int fd{-1};
+  journal_header header{};
+  std::mutex append_mutex;
+  inline static thread_local std::vector<journal_record> pending;
+};
+
+// Reservations are split into shards by reservation_id, each with its own
+// lock, so workers touching different reservations do not wait for each other
+struct reservation_shard {
+  std::mutex mutex;
+  ReservationTable table;
+  // table.next_expiration(), published under the lock and read without it,
+  // so the shards with nothing due are never locked to find it out
+  std::atomic<time_t> next_expiration{0};
+};
+
+// Snapshot file: the header, the event catalog (description offsets, the
+// description blob and ticket counts) and then the reservation records.
+// Every part starts at a multiple of SNAPSHOT_ALIGNMENT bytes.
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t cookie_mode;
+  uint64_t event_count;
+  uint64_t description_bytes;
+  uint64_t reservation_count;
+  uint64_t reservation_current_id;
+  uint64_t ticket_current_id;
+  uint8_t cookie_secret[COOKIE_SECRET_SIZE];
+};
+
+struct snapshot_reservation {
+  uint32_t reservation_id;
+  uint32_t event_id;
+  uint64_t first_ticket_id;
+  int64_t expiration_time;
+  uint16_t ticket_count;
+  uint8_t achieved;
+  // Zeroed for hmac cookies, which are derived from the rest
+  char cookie[COOKIE_SIZE];
+};
+
+// Positions of the parts of a snapshot described by its header
+struct snapshot_layout {
+  size_t description_offsets;
+  size_t descriptions;
+  size_t tickets;
+  size_t reservations;
+  size_t end;
+
+  explicit snapshot_layout(const snapshot_header &header) {
+    description_offsets = aligned(sizeof(snapshot_header));
+    descriptions = aligned(description_offsets +
+                           (header.event_count + 1) * sizeof(uint32_t));
+    tickets = aligned(descriptions + header.description_bytes);
+    reservations = aligned(tickets + header.event_count * sizeof(uint16_t));
+    end = reservations +
+          header.reservation_count * sizeof(snapshot_reservation);
+  }
+
+  static size_t aligned(size_t position) {
+    return (position + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT *
+           SNAPSHOT_ALIGNMENT;
+  }
+};
+
+static uint64_t monotonic_ns() {
+  struct timespec now {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// Statistics counters have a single writer, so they are increased with a
+// relaxed load and store instead of a locked add; readers see them late
+// at worst.
+static void increment(std::atomic<uint64_t> &counter, uint64_t value = 1) {
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+}
+
+// Sum of latency histograms, read out for the statistics file
+struct latency_summary {
+  std::array<uint64_t, STATS_HISTOGRAM_BUCKETS> buckets{};
+  uint64_t count{0};
+  uint64_t total_ns{0};
+  uint64_t max_ns{0};
+};
+
+// Log-linear histogram of latencies in nanoseconds, written by one worker
+class LatencyHistogram {
+public:
+  void record(uint64_t ns) {
+    increment(buckets[bucket_of(ns)]);
+    increment(total_ns, ns);
+    if (ns > max_ns.load(std::memory_order_relaxed)) {
+      max_ns.store(ns, std::memory_order_relaxed);
+    }
+  }
+
+  void add_to(latency_summary &summary) const {
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+      uint64_t bucket_count = buckets[i].load(std::memory_order_relaxed);
+      summary.buckets[i] += bucket_count;
+      summary.count += bucket_count;
+    }
+    summary.total_ns += total_ns.load(std::memory_order_relaxed);
+    summary.max_ns =
+        std::max(summary.max_ns, max_ns.load(std::memory_order_relaxed));
+  }
+
+  // The upper end of the bucket holding the given fraction of the samples
+  static uint64_t percentile(const latency_summary &summary, double fraction) {
+    auto rank = (uint64_t)std::ceil(fraction * (double)summary.count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+      seen += summary.buckets[i];
+      if (seen >= rank && seen > 0) {
+        return std::min(bucket_limit(i), summary.max_ns);
+      }
+    }
+    return 0;
+  }
+
+private:
+  static constexpr size_t HALF = (size_t)1 << (STATS_HISTOGRAM_SUB_BITS - 1);
+
+  // Values below 2^SUB_BITS have a bucket each; above, a value keeps its
+  // SUB_BITS leading bits, so buckets are at most 1/HALF of a value wide.
+  static size_t bucket_of(uint64_t value) {
+    if (value < 2 * HALF) {
+      return (size_t)value;
+    }
+    auto shift = (size_t)(63 - __builtin_clzll(value)) -
+                 (STATS_HISTOGRAM_SUB_BITS - 1);
+    return shift * HALF + (size_t)(value >> shift);
+  }
+
+  static uint64_t bucket_limit(size_t bucket) {
+    if (bucket < 2 * HALF) {
+      return bucket;
+    }
+    size_t shift = bucket / HALF - 1;
+    uint64_t leading = bucket % HALF + HALF;
+    return ((leading + 1) << shift) - 1;
+  }
+
+  std::array<std::atomic<uint64_t>, STATS_HISTOGRAM_BUCKETS> buckets{};
+  std::atomic<uint64_t> total_ns{0};
+  std::atomic<uint64_t> max_ns{0};
+};
+
+// Counters of one worker, kept on their own cache lines
+struct alignas(64) worker_statistics {
+  LatencyHistogram requests[REQUEST_TYPES];
+  // Time spent releasing expired reservations before each packet
+  LatencyHistogram expiry;
+  std::atomic<uint64_t> expired{0};
+  std::atomic<uint64_t> max_expired_per_packet{0};
+  std::atomic<uint64_t> bad_requests[BAD_REQUEST_REASONS]{};
+  std::atomic<uint64_t> malformed{0};
+  // GET_RESERVATION answered with an earlier reply
+  std::atomic<uint64_t> replayed{0};
+  // Requests dropped because their client sent too many, by type
+  std::atomic<uint64_t> rate_limited[REQUEST_TYPES]{};
+  // GET_EVENTS dropped from overloaded batches in the priority mode
+  std::atomic<uint64_t> shed{0};
+  // Datagrams the kernel dropped because a socket's queue was full, as
+  // seen by the batched mode
+  std::atomic<uint64_t> kernel_drops{0};
+
+  // GET_EVENTS, GET_RESERVATION and GET_TICKETS are 1, 3 and 5
+  static size_t request_type(uint8_t message_id) {
+    return (size_t)(message_id - 1) / 2;
+  }
+
+  void record_expiry(size_t expired_count, uint64_t ns) {
+    expiry.record(ns);
+    increment(expired, expired_count);
+    if (expired_count >
+        max_expired_per_packet.load(std::memory_order_relaxed)) {
+      max_expired_per_packet.store(expired_count, std::memory_order_relaxed);
+    }
+  }
+
+  void record_request(uint8_t message_id, BAD_REQUEST_REASON reason,
+                      uint64_t ns) {
+    requests[request_type(message_id)].record(ns);
+    if (reason != NOT_REFUSED) {
+      increment(bad_requests[reason]);
+    }
+  }
+};
+
+static const char *const request_type_names[REQUEST_TYPES] = {
+    "GET_EVENTS", "GET_RESERVATION", "GET_TICKETS"};
+
+static const char *const bad_request_reason_names[BAD_REQUEST_REASONS] = {
+    "none",
+    "zero_tickets",
+    "unknown_event",
+    "too_many_tickets",
+    "not_enough_tickets",
+    "unknown_reservation",
+    "wrong_cookie",
+    "reservation_expired",
+};
+
+// One handled datagram, written out later by the log thread
+struct log_record {
+  // Monotonic, when the worker started on the datagram
+  uint64_t time_ns;
+  // Address and port of the client, in network byte order
+  uint32_t address;
+  uint16_t port;
+  uint8_t message_id;
+  // message_id of the reply, 0 when the datagram was ignored
+  uint8_t reply_id;
+  // event_id or reservation_id the reply is about
+  uint32_t id;
+  uint8_t reason;
+};
+
+// Single producer, single consumer ring of log records: a worker pushes
+// and the log thread drains. The worker never waits for the log; when the
+// ring is full the record is dropped and counted.
+class LogRing {
+public:
+  void push(const log_record &record) {
+    size_t position = head.load(std::memory_order_relaxed);
+    if (position - cached_tail == LOG_RING_RECORDS) {
+      cached_tail = tail.load(std::memory_order_acquire);
+      if (position - cached_tail == LOG_RING_RECORDS) {
+        increment(dropped);
+        return;
+      }
+    }
+    records[position & (LOG_RING_RECORDS - 1)] = record;
+    head.store(position + 1, std::memory_order_release);
+  }
+
+  // Calls visit for every record pushed so far; returns their number.
+  template <typename F> size_t drain(F visit) {
+    size_t position = tail.load(std::memory_order_relaxed);
+    size_t end = head.load(std::memory_order_acquire);
+    for (size_t i = position; i < end; i++) {
+      visit(records[i & (LOG_RING_RECORDS - 1)]);
+    }
+    tail.store(end, std::memory_order_release);
+    return end - position;
+  }
+
+  [[nodiscard]] uint64_t get_dropped() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+private:
+  // Positions only grow. The producer's side and the consumer's side are
+  // on separate cache lines; the producer reads the tail again only when
+  // the ring looks full.
+  alignas(64) std::atomic<size_t> head{0};
+  size_t cached_tail{0};
+  std::atomic<uint64_t> dropped{0};
+  alignas(64) std::atomic<size_t> tail{0};
+  std::array<log_record, LOG_RING_RECORDS> records{};
+};
+
+static_assert((LOG_RING_RECORDS & (LOG_RING_RECORDS - 1)) == 0);
+
+static const char *message_name(uint8_t message_id) {
+  switch (message_id) {
+  case GET_EVENTS:
+    return "GET_EVENTS";
+  case EVENTS:
+    return "EVENTS";
+  case GET_RESERVATION:
+    return "GET_RESERVATION";
+  case RESERVATION:
+    return "RESERVATION";
+  case GET_TICKETS:
+    return "GET_TICKETS";
+  case TICKETS:
+    return "TICKETS";
+  case BAD_REQUEST:
+    return "BAD_REQUEST";
+  default:
+    return nullptr;
+  }
+}
+
+// Every worker holds its own lock while it handles requests, so taking all
+// of them waits until no request is half done.
+struct alignas(64) worker_lock {
+  std::mutex mutex;
+};
+
+// A worker's own copy of the EVENTS datagram, up to date with the changes
+// of the ticket counts logged before `version`
+struct alignas(64) events_replica {
+  std::vector<char> datagram;
+  uint64_t version{0};
+};
+
+// An entry of the log of ticket count changes: the version of the change
+// plus one above the id of the event whose count changed
+struct events_change {
+  static constexpr int event_bits = 16;
+  std::atomic<uint64_t> entry{0};
+};
+
+static_assert(BUFFER_SIZE / event_entry::length_with(0) <
+                  ((size_t)1 << events_change::event_bits),
+              "the id of every event in the datagram fits an entry");
+
+// Token buckets of the clients in one partition of the rate limits, by
+// source address: a client may send `rate` requests of a type per second,
+// in bursts of up to a second's worth. Clients are kept in an open
+// addressing table. When all the slots a new client may take are used, one
+// of them is evicted in clock order, where a client seen since the hand
+// last passed gets a second chance.
+class ClientRateLimiter {
+public:
+  void initialize(const std::array<uint32_t, REQUEST_TYPES> &limits) {
+    rates = limits;
+    clients.resize(RATE_LIMIT_ENTRIES);
+  }
+
+  // The top bits pick the partition, the ones below them the slot
+  static uint64_t hash_of(uint32_t address) {
+    return (uint64_t)address * 0x9e3779b97f4a7c15ULL;
+  }
+
+  // Takes a token of the request type from the client's bucket; returns
+  // false when the bucket is empty.
+  bool admit(uint32_t address, size_t type, uint64_t now_ns) {
+    if (rates[type] == 0) {
+      return true;
+    }
+    client_entry &client = find(address, now_ns);
+    client.referenced = true;
+    // Workers read the clock before they take the partition, so time may
+    // seem to go back a little
+    if (now_ns > client.refilled_ns) {
+      auto elapsed = (float)((double)(now_ns - client.refilled_ns) / 1e9);
+      client.refilled_ns = now_ns;
+      for (size_t i = 0; i < REQUEST_TYPES; i++) {
+        client.tokens[i] =
+            std::min((float)rates[i], client.tokens[i] + elapsed * rates[i]);
+      }
+    }
+    if (client.tokens[type] < 1) {
+      return false;
+    }
+    client.tokens[type] -= 1;
+    return true;
+  }
+
+private:
+  struct client_entry {
+    uint64_t refilled_ns{0};
+    float tokens[REQUEST_TYPES]{};
+    uint32_t address{0};
+    bool used{false};
+    bool referenced{false};
+  };
+
+  // Clients are never removed, only replaced, so a client is always found
+  // before the first unused slot of its window.
+  client_entry &find(uint32_t address, uint64_t now_ns) {
+    size_t home = (size_t)(hash_of(address) >>
+                           (64 - RATE_LIMIT_PARTITION_BITS - RATE_LIMIT_BITS));
+    client_entry *client = nullptr;
+    for (size_t i = 0; i < RATE_LIMIT_PROBES && client == nullptr; i++) {
+      client_entry &slot = clients[(home + i) & (RATE_LIMIT_ENTRIES - 1)];
+      if (!slot.used) {
+        client = &slot;
+      } else if (slot.address == address) {
+        return slot;
+      }
+    }
+    if (client == nullptr) {
+      client = &evict(home);
+    }
+    client->used = true;
+    client->address = address;
+    client->refilled_ns = now_ns;
+    for (size_t i = 0; i < REQUEST_TYPES; i++) {
+      client->tokens[i] = (float)rates[i];
+    }
+    return *client;
+  }
+
+  client_entry &evict(size_t home) {
+    while (true) {
+      client_entry &slot =
+          clients[(home + clock_hand % RATE_LIMIT_PROBES) &
+                  (RATE_LIMIT_ENTRIES - 1)];
+      clock_hand++;
+      if (!slot.referenced) {
+        return slot;
+      }
+      slot.referenced = false;
+    }
+  }
+
+  std::array<uint32_t, REQUEST_TYPES> rates{};
+  std::vector<client_entry> clients;
+  size_t clock_hand{0};
+};
+
+// Every client address is limited by exactly one partition, shared by all
+// workers, so sending from many ports gets a client nothing more
+struct alignas(64) rate_limit_partition {
+  std::mutex mutex;
+  ClientRateLimiter limiter;
+};
+
+// Class for server data: events, reservations, etc.
+// Shared by all workers: event inventory is only changed atomically and
+// reservations only under the lock of their shard.
+class Data {
+
+public:
+  explicit Data(const ServerParameters &parameters)
+      : parameters(parameters), shards(parameters.get_workers()),
+        worker_locks(parameters.get_workers()),
+        statistics(parameters.get_workers()) {
+    if (parameters.get_log_path() != nullptr) {
+      log_file = fopen(parameters.get_log_path(), "a");
+      ENSURE(log_file != nullptr);
+    } else if (debug) {
+      log_file = stderr;
+    }
+    if (is_logging()) {
+      log_rings = std::vector<LogRing>(parameters.get_workers());
+    }
+    events_changes = std::vector<events_change>(EVENTS_CHANGE_LOG);
+    const std::array<uint32_t, REQUEST_TYPES> &rates =
+        parameters.get_rate_limits();
+    if (std::any_of(rates.begin(), rates.end(),
+                    [](uint32_t rate) { return rate > 0; })) {
+      rate_limits = std::vector<rate_limit_partition>(
+          (size_t)1 << RATE_LIMIT_PARTITION_BITS);
+      for (rate_limit_partition &partition : rate_limits) {
+        partition.limiter.initialize(rates);
+      }
+    }
+    for (reservation_shard &shard : shards) {
+      shard.table.initialize(shards.size(),
+                             parameters.get_cookie_mode() == RANDOM_COOKIES);
+    }
+    reservation::initialize_ids();
+    bool restored =
+        parameters.get_snapshot_path() != nullptr && load_snapshot();
+    if (!restored) {
+      parse_from_file();
+    }
+    // Reservations achieved before the snapshot are still in the archive
+    if (parameters.get_archive_path() != nullptr) {
+      archive.open_file(parameters.get_archive_path(), !restored);
+    }
+    if (parameters.get_journal_path() != nullptr) {
+      open_journal();
+    }
+    for (reservation_shard &shard : shards) {
+      publish_next_expiration(shard);
+    }
+    build_events_datagram();
+    events_replicas = std::vector<events_replica>(parameters.get_workers());
+    for (events_replica &replica : events_replicas) {
+      replica.datagram = events_datagram;
+    }
+  }
+
+  virtual ~Data() {
+    if (snapshot_memory != nullptr) {
+      munmap(snapshot_memory, snapshot_size);
+    }
+    if (log_file != nullptr && log_file != stderr) {
+      fclose(log_file);
+    }
+  }
+
+private:
+  void parse_from_file() { events.load(parameters.get_file_path()); }
+
+  void open_journal() {
+    journal_header header{};
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.cookie_mode = (uint32_t)parameters.get_cookie_mode();
+    memcpy(header.cookie_secret, signer.get_secret(), COOKIE_SECRET_SIZE);
+    std::vector<journal_record> records =
+        journal.open_file(parameters.get_journal_path(), header);
+    signer.set_secret(journal.get_header().cookie_secret);
+    replay_journal(records);
+  }
+
+  // Applies the journal on top of the events file or the snapshot. Records
+  // already reflected in the snapshot change nothing: their reservations
+  // are either older than its next reservation_id or in their final state.
+  void replay_journal(const std::vector<journal_record> &records) {
+    size_t known_reservations = reservation::reservation_current_id;
+    for (const journal_record &record : records) {
+      auto reservation_id = (int)record.reservation_id;
+      reservation_shard &shard = get_shard(reservation_id);
+      reservation *r = shard.table.find(reservation_id);
+
+      switch (record.type) {
+      case JOURNAL_CREATE:
+        if (record.reservation_id >= known_reservations) {
+          ENSURE(events.contains((int)record.event_id));
+          events.get_tickets((int)record.event_id) -= record.ticket_count;
+          shard.table.insert(reservation_id,
+                             reservation(record.event_id, record.ticket_count,
+                                         record.expiration_time),
+                             record.cookie);
+          reservation::reservation_current_id =
+              std::max<size_t>(reservation::reservation_current_id,
+                               record.reservation_id + 1);
+        }
+        break;
+
+      case JOURNAL_EXPIRE:
+        if (r != nullptr && !r->achieved) {
+          events.get_tickets((int)r->event_id) += r->ticket_count;
+          shard.table.erase(reservation_id);
+        }
+        break;
+
+      default:
+        if (r != nullptr && !r->achieved) {
+          shard.table.achieve(reservation_id);
+          r->first_ticket_id = record.first_ticket_id;
+          reservation::ticket_current_id =
+              std::max<size_t>(reservation::ticket_current_id,
+                               r->first_ticket_id + r->ticket_count);
+          if (archive.is_open()) {
+            char cookie[COOKIE_SIZE];
+            expected_cookie_of(shard, reservation_id, *r, cookie);
+            archive.store(reservation_id, *r, cookie);
+            shard.table.erase(reservation_id);
+          }
+        }
+      }
+    }
+  }
+
+  // The catalog keeps using the mapped descriptions, so only ticket counts
+  // and reservations are copied. Returns false when there is no snapshot yet.
+  bool load_snapshot() {
+    int fd = open(parameters.get_snapshot_path(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat file_stat {};
+    ENSURE(fstat(fd, &file_stat) == 0);
+    auto size = (size_t)file_stat.st_size;
+    if (size == 0) {
+      close(fd);
+      return false;
+    }
+    snapshot_memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    ENSURE(snapshot_memory != MAP_FAILED);
+    snapshot_size = size;
+    const char *file = (const char *)snapshot_memory;
+
+    snapshot_header header{};
+    ENSURE(size >= sizeof(header));
+    memcpy(&header, file, sizeof(header));
+    ENSURE(memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0);
+    ENSURE(header.version == SNAPSHOT_VERSION);
+    ENSURE(header.cookie_mode == (uint32_t)parameters.get_cookie_mode());
+    snapshot_layout layout(header);
+    ENSURE(size >= layout.end);
+
+    events.restore(header.event_count,
+                   (const uint32_t *)(file + layout.description_offsets),
+                   file + layout.descriptions,
+                   (const uint16_t *)(file + layout.tickets));
+    for (size_t i = 0; i < header.reservation_count; i++) {
+      snapshot_reservation record{};
+      memcpy(&record, file + layout.reservations + i * sizeof(record),
+             sizeof(record));
+      reservation r(record.event_id, record.ticket_count,
+                    record.expiration_time);
+      r.achieved = record.achieved != 0;
+      r.first_ticket_id = record.first_ticket_id;
+      get_shard((int)record.reservation_id)
+          .table.insert((int)record.reservation_id, r, record.cookie);
+    }
+    reservation::reservation_current_id = header.reservation_current_id;
+    reservation::ticket_current_id = header.ticket_current_id;
+    signer.set_secret(header.cookie_secret);
+    return true;
+  }
+
+  // The EVENTS message is serialized once; afterwards only the ticket_count
+  // of an event is patched in place when its tickets_available changes.
+  // The datagram holds the events with the first datagram_events ids; only
+  // they have an offset, so the rest of the catalog is never looked at.
+  void build_events_datagram() {
+    events_datagram.assign(BUFFER_SIZE, 0);
+    ticket_count_offsets.clear();
+    size_t index = events_message::encode(events_datagram.data());
+
+    for (int id = 0; id < (int)events.size(); id++) {
+      uint8_t description_length = events.get_description_length(id);
+      if (index + event_entry::length_with(description_length) > BUFFER_SIZE) {
+        break;
+      }
+      ticket_count_offsets.push_back(
+          (uint32_t)(index + event_entry::ticket_count_offset));
+      index += event_entry::encode(
+          events_datagram.data() + index, (uint32_t)id,
+          events.get_tickets(id).load(), events.get_description(id),
+          description_length);
+    }
+    events_datagram.resize(index);
+    datagram_events = ticket_count_offsets.size();
+  }
+
+  // Called after the ticket count of the event changed. Only the id of the
+  // event is logged; workers read the count itself when they catch up.
+  void update_events_datagram(int event_id) {
+    if ((size_t)event_id >= datagram_events) {
+      return;
+    }
+    uint64_t version = events_version.fetch_add(1);
+    events_changes[version & (EVENTS_CHANGE_LOG - 1)].entry.store(
+        ((version + 1) << events_change::event_bits) | (uint64_t)event_id,
+        std::memory_order_release);
+  }
+
+  // Only for the events in the datagram
+  void patch_ticket_count(std::vector<char> &datagram, size_t event_id) {
+    ticket_count_field::write(datagram.data() + ticket_count_offsets[event_id],
+                              events.get_tickets((int)event_id).load());
+  }
+
+  // Called with the shard locked, after its expiry heap changed
+  static void publish_next_expiration(reservation_shard &shard) {
+    shard.next_expiration.store(shard.table.next_expiration(),
+                                std::memory_order_relaxed);
+  }
+
+  reservation_shard &get_shard(int reservation_id) {
+    return shards[((size_t)reservation_id - FIRST_RESERVATION_ID) %
+                  shards.size()];
+  }
+
+public:
+  // Waits for all workers to finish their requests and keeps them waiting
+  // while the state is written. The snapshot is written to a temporary file
+  // which replaces the previous one only when it is complete.
+  void write_snapshot() {
+    std::vector<std::unique_lock<std::mutex>> quiesced;
+    for (worker_lock &lock : worker_locks) {
+      quiesced.emplace_back(lock.mutex);
+    }
+
+    std::vector<snapshot_reservation> records;
+    for (reservation_shard &shard : shards) {
+      shard.table.for_each(
+          [&](int reservation_id, const reservation &r, const char *cookie) {
+            snapshot_reservation record{};
+            record.reservation_id = (uint32_t)reservation_id;
+            record.event_id = r.event_id;
+            record.first_ticket_id = r.first_ticket_id;
+            record.expiration_time = r.expiration_time;
+            record.ticket_count = r.ticket_count;
+            record.achieved = r.achieved;
+            if (cookie != nullptr) {
+              memcpy(record.cookie, cookie, COOKIE_SIZE);
+            }
+            records.push_back(record);
+          });
+    }
+
+    snapshot_header header{};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.cookie_mode = (uint32_t)parameters.get_cookie_mode();
+    header.event_count = events.size();
+    header.description_bytes = events.get_description_bytes();
+    header.reservation_count = records.size();
+    header.reservation_current_id = reservation::reservation_current_id;
+    header.ticket_current_id = reservation::ticket_current_id;
+    memcpy(header.cookie_secret, signer.get_secret(), COOKIE_SECRET_SIZE);
+    snapshot_layout layout(header);
+
+    std::vector<uint16_t> tickets(events.size());
+    for (size_t i = 0; i < events.size(); i++) {
+      tickets[i] = events.get_tickets((int)i).load();
+    }
+
+    string temporary_path = string(parameters.get_snapshot_path()) + ".tmp";
+    FILE *file = fopen(temporary_path.c_str(), "w");
+    ENSURE(file != nullptr);
+    size_t position = 0;
+    auto write_part = [&](size_t part_position, const void *part,
+                          size_t size) {
+      static const char padding[SNAPSHOT_ALIGNMENT]{};
+      ENSURE(fwrite(padding, 1, part_position - position, file) ==
+             part_position - position);
+      ENSURE(fwrite(part, 1, size, file) == size);
+      position = part_position + size;
+    };
+    write_part(0, &header, sizeof(header));
+    write_part(layout.description_offsets, events.get_description_offsets(),
+               (events.size() + 1) * sizeof(uint32_t));
+    write_part(layout.descriptions, events.get_descriptions(),
+               header.description_bytes);
+    write_part(layout.tickets, tickets.data(),
+               tickets.size() * sizeof(uint16_t));
+    write_part(layout.reservations, records.data(),
+               records.size() * sizeof(snapshot_reservation));
+    ENSURE(fflush(file) == 0 && fsync(fileno(file)) == 0);
+    fclose(file);
+    ENSURE(rename(temporary_path.c_str(), parameters.get_snapshot_path()) ==
+           0);
+    if (journal.is_open()) {
+      journal.start(journal.get_header());
+    }
+  }
+
+  // Sums the counters of all workers into a JSON object and replaces the
+  // statistics file with it. Workers are never stopped: the shard locks
+  // are taken one at a time for the reservation counts only.
+  void write_statistics() {
+    latency_summary requests[REQUEST_TYPES];
+    latency_summary expiry;
+    uint64_t bad_requests[BAD_REQUEST_REASONS]{};
+    uint64_t malformed = 0;
+    uint64_t replayed = 0;
+    uint64_t rate_limited[REQUEST_TYPES]{};
+    uint64_t shed = 0;
+    uint64_t kernel_drops = 0;
+    uint64_t expired = 0;
+    uint64_t max_expired_per_packet = 0;
+    for (const worker_statistics &worker : statistics) {
+      for (size_t i = 0; i < REQUEST_TYPES; i++) {
+        worker.requests[i].add_to(requests[i]);
+      }
+      worker.expiry.add_to(expiry);
+      for (size_t i = 0; i < BAD_REQUEST_REASONS; i++) {
+        bad_requests[i] += worker.bad_requests[i].load();
+      }
+      malformed += worker.malformed.load();
+      replayed += worker.replayed.load();
+      for (size_t i = 0; i < REQUEST_TYPES; i++) {
+        rate_limited[i] += worker.rate_limited[i].load();
+      }
+      shed += worker.shed.load();
+      kernel_drops += worker.kernel_drops.load();
+      expired += worker.expired.load();
+      max_expired_per_packet = std::max(max_expired_per_packet,
+                                        worker.max_expired_per_packet.load());
+    }
+
+    size_t kept = 0;
+    size_t pending = 0;
+    for (reservation_shard &shard : shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      kept += shard.table.size();
+      pending += shard.table.pending();
+    }
+    size_t sold_out = 0;
+    for (size_t i = 0; i < events.size(); i++) {
+      sold_out += events.get_tickets((int)i).load() == 0;
+    }
+
+    string temporary_path = string(parameters.get_stats_path()) + ".tmp";
+    FILE *file = fopen(temporary_path.c_str(), "w");
+    ENSURE(file != nullptr);
+    auto write_latency = [file](const latency_summary &summary) {
+      fprintf(file,
+              "\"count\": %lu, \"mean_ns\": %lu, \"p50_ns\": %lu, "
+              "\"p90_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, "
+              "\"max_ns\": %lu",
+              summary.count,
+              summary.count == 0 ? 0 : summary.total_ns / summary.count,
+              LatencyHistogram::percentile(summary, 0.5),
+              LatencyHistogram::percentile(summary, 0.9),
+              LatencyHistogram::percentile(summary, 0.99),
+              LatencyHistogram::percentile(summary, 0.999), summary.max_ns);
+    };
+    fprintf(file, "{\n  \"uptime_ms\": %lu,\n  \"requests\": {\n",
+            (monotonic_ns() - start_ns) / 1000000);
+    for (size_t i = 0; i < REQUEST_TYPES; i++) {
+      fprintf(file, "    \"%s\": {", request_type_names[i]);
+      write_latency(requests[i]);
+      fprintf(file, "}%s\n", i + 1 < REQUEST_TYPES ? "," : "");
+    }
+    fprintf(file, "  },\n  \"bad_requests\": {");
+    for (size_t i = NOT_REFUSED + 1; i < BAD_REQUEST_REASONS; i++) {
+      fprintf(file, "%s\"%s\": %lu", i > NOT_REFUSED + 1 ? ", " : "",
+              bad_request_reason_names[i], bad_requests[i]);
+    }
+    fprintf(file,
+            "},\n  \"malformed_packets\": %lu,\n  \"replayed_reservations\": "
+            "%lu,\n  \"rate_limited\": {",
+            malformed, replayed);
+    for (size_t i = 0; i < REQUEST_TYPES; i++) {
+      fprintf(file, "%s\"%s\": %lu", i > 0 ? ", " : "", request_type_names[i],
+              rate_limited[i]);
+    }
+    fprintf(file,
+            "},\n  \"shed_events\": %lu,\n  \"kernel_drops\": %lu,\n  "
+            "\"expiry\": {",
+            shed, kernel_drops);
+    write_latency(expiry);
+    fprintf(file,
+            ", \"expired_reservations\": %lu, \"max_expired_per_packet\": "
+            "%lu},\n",
+            expired, max_expired_per_packet);
+    fprintf(file,
+            "  \"reservations\": {\"pending\": %zu, \"achieved_in_memory\": "
+            "%zu, \"archived_since_start\": %zu},\n",
+            pending, kept - pending, archive.get_stored());
+    fprintf(file, "  \"events\": {\"count\": %zu, \"sold_out\": %zu},\n",
+            events.size(), sold_out);
+    uint64_t log_dropped = 0;
+    for (const LogRing &ring : log_rings) {
+      log_dropped += ring.get_dropped();
+    }
+    fprintf(file, "  \"log\": {\"written\": %lu, \"dropped\": %lu}\n}\n",
+            log_written.load(), log_dropped);
+    ENSURE(fclose(file) == 0);
+    ENSURE(rename(temporary_path.c_str(), parameters.get_stats_path()) == 0);
+  }
+
+  // Without a log file requests are logged only by debug builds, to stderr.
+  [[nodiscard]] bool is_logging() const { return log_file != nullptr; }
+
+  // nullptr when requests are not logged
+  LogRing *get_log_ring(size_t worker) {
+    return is_logging() ? &log_rings[worker] : nullptr;
+  }
+
+  // Formats and writes out every record the workers logged since the last
+  // call; only the log thread calls it.
+  void flush_log() {
+    size_t written = 0;
+    for (LogRing &ring : log_rings) {
+      written += ring.drain(
+          [this](const log_record &record) { write_log_line(record); });
+    }
+    if (written > 0) {
+      fflush(log_file);
+      log_written.fetch_add(written, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  // For example:
+  // 2026-10-17T01:02:03.456789Z 127.0.0.1:40000 GET_RESERVATION -> BAD_REQUEST
+  // not_enough_tickets event_id=3
+  void write_log_line(const log_record &record) {
+    uint64_t time_ns = record.time_ns + realtime_offset_ns;
+    auto seconds = (time_t)(time_ns / 1000000000);
+    struct tm calendar {};
+    gmtime_r(&seconds, &calendar);
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &calendar);
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &record.address, address, sizeof(address));
+    fprintf(log_file, "%s.%06luZ %s:%u ", timestamp,
+            (time_ns % 1000000000) / 1000, address, ntohs(record.port));
+
+    const char *request = message_name(record.message_id);
+    if (request != nullptr) {
+      fprintf(log_file, "%s -> ", request);
+    } else {
+      fprintf(log_file, "message_id=%u -> ", record.message_id);
+    }
+    if (record.reply_id == 0) {
+      fprintf(log_file, "ignored\n");
+      return;
+    }
+    fprintf(log_file, "%s", message_name(record.reply_id));
+    if (record.reply_id == BAD_REQUEST) {
+      fprintf(log_file, " %s", bad_request_reason_names[record.reason]);
+    }
+    if (record.reply_id != EVENTS) {
+      bool refused_reservation = record.reply_id == BAD_REQUEST &&
+                                 record.message_id == GET_RESERVATION;
+      fprintf(log_file, " %s=%u",
+              refused_reservation ? "event_id" : "reservation_id", record.id);
+    }
+    fprintf(log_file, "\n");
+  }
+
+  static uint64_t realtime_minus_monotonic_ns() {
+    struct timespec now {};
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec -
+           monotonic_ns();
+  }
+
+public:
+  // Called by every worker after a batch, before its replies are sent.
+  void commit_journal() { journal.commit(); }
+
+  std::mutex &get_worker_lock(size_t worker) {
+    return worker_locks[worker].mutex;
+  }
+
+  worker_statistics &get_statistics(size_t worker) {
+    return statistics[worker];
+  }
+
+  // Reservations waiting for their tickets are kept in an expiry heap of
+  // their shard, so only the ones that are actually due are visited, and
+  // only the shards that have any are locked. Returns the number of
+  // reservations released.
+  size_t remove_expired_reservations(time_t &current_time) {
+    size_t released = 0;
+    for (reservation_shard &shard : shards) {
+      time_t due = shard.next_expiration.load(std::memory_order_relaxed);
+      if (due == 0 || due >= current_time) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.table.remove_expired(
+          current_time, [&](int reservation_id, const reservation &r) {
+            journal.record_expire(reservation_id);
+            events.get_tickets((int)r.event_id) += r.ticket_count;
+            update_events_datagram((int)r.event_id);
+            released++;
+          });
+      publish_next_expiration(shard);
+    }
+    return released;
+  }
+
+  // Expiration time of the reservation due first in any shard, 0 when none
+  // waits for its tickets.
+  time_t next_expiration() {
+    time_t next = 0;
+    for (reservation_shard &shard : shards) {
+      time_t shard_next = shard.next_expiration.load(std::memory_order_relaxed);
+      if (shard_next != 0 && (next == 0 || shard_next < next)) {
+        next = shard_next;
+      }
+    }
+    return next;
+  }
+
+  // Takes the tickets from the event only if enough of them are left, so
+  // concurrent reservations can never oversell it.
+  bool take_tickets(int event_id, uint16_t ticket_count) {
+    std::atomic<uint16_t> &available = events.get_tickets(event_id);
+    uint16_t current = available.load();
+    do {
+      if (current < ticket_count) {
+        return false;
+      }
+    } while (!available.compare_exchange_weak(current, current - ticket_count));
+    update_events_datagram(event_id);
+    return true;
+  }
+
+  // The tickets must have been taken with take_tickets before.
+  void add_reservation(int reservation_id, const reservation &new_reservation,
+                       const char *cookie) {
+    reservation_shard &shard = get_shard(reservation_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.table.insert(reservation_id, new_reservation, cookie);
+    publish_next_expiration(shard);
+    journal.record_create(reservation_id, new_reservation, cookie);
+  }
+
+private:
+  void expected_cookie_of(reservation_shard &shard, int reservation_id,
+                          const reservation &r, char *cookie) {
+    if (parameters.get_cookie_mode() == HMAC_COOKIES) {
+      signer.sign(reservation_id, r.event_id, r.expiration_time, cookie);
+    } else {
+      memcpy(cookie, shard.table.get_cookie(reservation_id), COOKIE_SIZE);
+    }
+  }
+
+public:
+  // Random cookies are stored with the reservation; hmac ones are derived
+  // from it, so the same call gives the cookie of the RESERVATION reply.
+  void new_cookie(int reservation_id, const reservation &r, char *cookie) {
+    if (parameters.get_cookie_mode() == HMAC_COOKIES) {
+      signer.sign(reservation_id, r.event_id, r.expiration_time, cookie);
+    } else {
+      reservation::generate_cookie(cookie);
+    }
+  }
+
+  // Fills r with the reservation whose tickets may be sent, issuing them on
+  // the first valid GET_TICKETS. With an archive, the reservation is moved
+  // there at that moment and its slot is freed.
+  BAD_REQUEST_REASON collect_tickets(int reservation_id, const char *cookie,
+                                     time_t current_time, reservation &r) {
+    reservation_shard &shard = get_shard(reservation_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    reservation *live = shard.table.find(reservation_id);
+    if (live == nullptr) {
+      return archive.is_open() ? archive.find(reservation_id, cookie, r)
+                               : UNKNOWN_RESERVATION;
+    }
+
+    char expected_cookie[COOKIE_SIZE];
+    expected_cookie_of(shard, reservation_id, *live, expected_cookie);
+    if (!CookieSigner::equal(expected_cookie, cookie)) {
+      return WRONG_COOKIE;
+    }
+    if (!live->achieved && (live->expiration_time < current_time)) {
+      return RESERVATION_EXPIRED;
+    }
+    if (!live->achieved) {
+      shard.table.achieve(reservation_id);
+      publish_next_expiration(shard);
+      live->generate_tickets();
+      journal.record_achieve(reservation_id, *live);
+    }
+    r = *live;
+    if (archive.is_open()) {
+      archive.store(reservation_id, r, expected_cookie);
+      shard.table.erase(reservation_id);
+    }
+    return NOT_REFUSED;
+  }
+
+  [[nodiscard]] bool is_rate_limited() const { return !rate_limits.empty(); }
+
+  // Takes a token of the request type from the client address's bucket;
+  // returns false when the client sent too many requests of the type.
+  bool admit_request(uint32_t address, size_t type, uint64_t now_ns) {
+    rate_limit_partition &partition =
+        rate_limits[ClientRateLimiter::hash_of(address) >>
+                    (64 - RATE_LIMIT_PARTITION_BITS)];
+    std::lock_guard<std::mutex> lock(partition.mutex);
+    return partition.limiter.admit(address, type, now_ns);
+  }
+
+  // Whether the reservation exists and still waits for its tickets
+  bool is_reservation_pending(int reservation_id, time_t current_time) {
+    reservation_shard &shard = get_shard(reservation_id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    reservation *live = shard.table.find(reservation_id);
+    return live != nullptr && !live->achieved &&
+           live->expiration_time >= current_time;
+  }
+
+  BAD_REQUEST_REASON check_reservation(int event_id, int ticket_count) {
+    if (ticket_count == 0) {
+      return ZERO_TICKETS;
+    }
+    if (!events.contains(event_id)) {
+      return UNKNOWN_EVENT;
+    }
+    if ((size_t)ticket_count > tickets_message::max_tickets) {
+      return TOO_MANY_TICKETS;
+    }
+    return NOT_REFUSED;
+  }
+
+  // Only the worker patches its datagram and the sockets backend sends
+  // its replies before the worker goes on, so there they are sent straight
+  // from it. io_uring may still be sending when the next request is
+  // handled, so it gets a copy.
+  [[nodiscard]] bool can_share_events_datagram() const {
+    return parameters.get_io_backend() == SOCKETS_BACKEND;
+  }
+
+  // Brings the worker's datagram up to date with every ticket count change
+  // logged so far and returns it. A count changes before its version is
+  // taken and the counts are read from the catalog, so a change whose log
+  // entry is still being written, or was overwritten before the worker saw
+  // it, is caught by patching every event.
+  const std::vector<char> &get_events_datagram(size_t worker) {
+    events_replica &replica = events_replicas[worker];
+    uint64_t current = events_version.load(std::memory_order_acquire);
+    bool complete = current - replica.version <= EVENTS_CHANGE_LOG;
+    for (uint64_t version = replica.version; complete && version < current;
+         version++) {
+      uint64_t entry = events_changes[version & (EVENTS_CHANGE_LOG - 1)]
+                           .entry.load(std::memory_order_acquire);
+      complete = (entry >> events_change::event_bits) ==
+                 ((version + 1) & (UINT64_MAX >> events_change::event_bits));
+      if (complete) {
+        patch_ticket_count(replica.datagram,
+                           entry & ((1 << events_change::event_bits) - 1));
+      }
+    }
+    if (!complete) {
+      for (size_t id = 0; id < datagram_events; id++) {
+        patch_ticket_count(replica.datagram, id);
       }
     }
+    replica.version = current;
+    return replica.datagram;
   }
 
-  void try_to_insert_reservation(Data &data, time_t time, int timeout) {
-    read_index = 1;
-    uint32_t event_id;
-    uint16_t ticket_count;
-    receive_number(event_id);
-    receive_number(ticket_count);
-    if (data.validate_reservation((int)event_id, ticket_count)) {
+  [[nodiscard]] EventCatalog &get_events() { return events; }
+
+private:
+  const ServerParameters &parameters;
+  EventCatalog events;
+  std::vector<reservation_shard> shards;
+  // Built once at startup; only the workers' copies are patched
+  std::vector<char> events_datagram;
+  std::vector<uint32_t> ticket_count_offsets;
+  size_t datagram_events{0};
+  std::vector<events_replica> events_replicas;
+  std::vector<events_change> events_changes;
+  std::atomic<uint64_t> events_version{0};
+  CookieSigner signer;
+  ReservationArchive archive;
+  Journal journal;
+  std::vector<worker_lock> worker_locks;
+  std::vector<worker_statistics> statistics;
+  std::vector<rate_limit_partition> rate_limits;
+  uint64_t start_ns{monotonic_ns()};
+  FILE *log_file{nullptr};
+  std::vector<LogRing> log_rings;
+  uint64_t realtime_offset_ns{realtime_minus_monotonic_ns()};
+  std::atomic<uint64_t> log_written{0};
+  void *snapshot_memory{nullptr};
+  size_t snapshot_size{0};
+};
+
+// Class for operations on buffer, mostly converting data to proper format
+class Buffer {
+
+private:
+  void insert_tickets(int reservation_id, const reservation &r) {
+    prepared_reply = nullptr;
+    tickets_message::encode(buffer, (uint32_t)reservation_id, r.ticket_count);
+    reservation::write_tickets(r.first_ticket_id, r.ticket_count,
+                               tickets_message::ticket(buffer, 0));
+    send_index = tickets_message::length_with(r.ticket_count);
+  }
+
+  void insert_reservation(int reservation_id, const reservation &r,
+                          const char *cookie) {
+    prepared_reply = nullptr;
+    send_index = reservation_message::encode(
+        buffer, (uint32_t)reservation_id, r.event_id, r.ticket_count, cookie,
+        (uint64_t)r.expiration_time);
+  }
+
+  void insert_bad_request(int id) {
+    prepared_reply = nullptr;
+    send_index = bad_request_message::encode(buffer, (uint32_t)id);
+  }
+
+public:
+  // Sends a copy of a reply that was built before
+  void insert_reply(const char *reply, size_t length) {
+    prepared_reply = nullptr;
+    memcpy(buffer, reply, length);
+    send_index = length;
+  }
+
+  void insert_events(Data &data, size_t worker) {
+    prepared_reply = nullptr;
+    const std::vector<char> &datagram = data.get_events_datagram(worker);
+
+    if (data.can_share_events_datagram()) {
+      events_message::encode(buffer);
+      prepared_reply = datagram.data();
+    } else {
+      memcpy(buffer, datagram.data(), datagram.size());
+    }
+    send_index = datagram.size();
+  }
+
+  // Both return why the request was refused, NOT_REFUSED if it was not
+  BAD_REQUEST_REASON try_to_insert_reservation(Data &data, time_t time,
+                                               int timeout) {
+    uint32_t event_id = get_reservation_message::get<0>(buffer);
+    uint16_t ticket_count = get_reservation_message::get<1>(buffer);
+    BAD_REQUEST_REASON reason =
+        data.check_reservation((int)event_id, ticket_count);
+    if (reason == NOT_REFUSED &&
+        !data.take_tickets((int)event_id, ticket_count)) {
+      reason = NOT_ENOUGH_TICKETS;
+    }
+    if (reason == NOT_REFUSED) {
 
       int reservation_id = (int)reservation::new_reservation_id();
       reservation new_reservation =
           reservation(event_id, ticket_count, time + timeout);
-      data.getReservationsMap().insert({reservation_id, new_reservation});
-      data.get_events_map().at((int)event_id).tickets_available -= ticket_count;
-      insert_reservation(reservation_id, new_reservation);
+      char cookie[COOKIE_SIZE];
+      data.new_cookie(reservation_id, new_reservation, cookie);
+      insert_reservation(reservation_id, new_reservation, cookie);
+      data.add_reservation(reservation_id, new_reservation, cookie);
 
     } else {
       insert_bad_request((int)event_id);
     }
+    return reason;
   }
 
-  void try_to_insert_tickets(Data &data, time_t time) {
-    reset_read_index();
-
-    int reservation_id;
-    receive_number(reservation_id);
-    string cookie = receive_cookie();
-    if (data.validate_tickets(reservation_id, cookie, time)) {
-      reservation &r = data.getReservationsMap().at(reservation_id);
-      if (!r.achieved) {
-        r.achieved = true;
-        for (int i = 0; i < r.ticket_count; i++) {
-          r.generate_ticket();
-        }
-      }
+  BAD_REQUEST_REASON try_to_insert_tickets(Data &data, time_t time) {
+    int reservation_id = (int)get_tickets_message::get<0>(buffer);
+    // The cookie is used in place, while the request is in the buffer
+    const char *cookie = get_tickets_message::get<1>(buffer);
+    reservation r;
+    BAD_REQUEST_REASON reason =
+        data.collect_tickets(reservation_id, cookie, time, r);
+    if (reason == NOT_REFUSED) {
       insert_tickets(reservation_id, r);
 
     } else {
       insert_bad_request(reservation_id);
     }
+    return reason;
   }
 
   [[nodiscard]] size_t get_size() const { return send_index; }
@@ -492,147 +2923,1014 @@ public:
 
   char *get() { return buffer; }
 
+  // Usually the buffer itself, but a prepared message may be sent instead
+  [[nodiscard]] const char *get_reply() const {
+    return prepared_reply != nullptr ? prepared_reply : buffer;
+  }
+
 private:
   char buffer[BUFFER_SIZE]{};
+  const char *prepared_reply{nullptr};
   size_t send_index{0};
-  size_t read_index{1};
+};
+
+// The RESERVATION reply last sent to each client of one worker, so that a
+// client retransmitting a GET_RESERVATION whose reply was lost gets the
+// same reservation again instead of holding more tickets. A retransmission
+// comes from the same address and port, which SO_REUSEPORT sends to the
+// same worker, and nothing else comes from there in between. So any other
+// request of the client forgets its reply, and an identical request sent
+// after it is a new one. The cache is direct mapped: a new reply simply
+// takes the place of whatever was in its slot.
+class ReservationReplies {
+public:
+  // A window of 0 disables the cache
+  explicit ReservationReplies(time_t window) : window(window) {
+    if (window > 0) {
+      entries.resize(DEDUP_CACHE_ENTRIES);
+    }
+  }
+
+  [[nodiscard]] bool is_enabled() const { return !entries.empty(); }
+
+  // Replaces the GET_RESERVATION in message with the reply the client got
+  // for it, if it is still within the window and the reservation still
+  // waits for its tickets.
+  bool replay(Data &data, const struct sockaddr_in &client,
+              time_t current_time, Buffer &message) {
+    uint32_t event_id = get_reservation_message::get<0>(message.get());
+    uint16_t ticket_count = get_reservation_message::get<1>(message.get());
+    reply_entry &entry = entries[slot_of(client)];
+    if (entry.replay_until < current_time ||
+        entry.address != client.sin_addr.s_addr ||
+        entry.port != client.sin_port ||
+        reservation_message::get<1>(entry.reply) != event_id ||
+        reservation_message::get<2>(entry.reply) != ticket_count ||
+        !data.is_reservation_pending(
+            (int)reservation_message::get<0>(entry.reply), current_time)) {
+      return false;
+    }
+    message.insert_reply(entry.reply, reservation_message::length);
+    return true;
+  }
+
+  // Called with the RESERVATION reply in message
+  void remember(const struct sockaddr_in &client, time_t current_time,
+                const Buffer &message) {
+    const char *reply = message.get_reply();
+    reply_entry &entry = entries[slot_of(client)];
+    entry.address = client.sin_addr.s_addr;
+    entry.port = client.sin_port;
+    entry.replay_until =
+        std::min(current_time + window,
+                 (time_t)reservation_message::get<4>(reply));
+    memcpy(entry.reply, reply, reservation_message::length);
+  }
+
+  // Called for every other request of the client
+  void forget(const struct sockaddr_in &client) {
+    reply_entry &entry = entries[slot_of(client)];
+    if (entry.address == client.sin_addr.s_addr &&
+        entry.port == client.sin_port) {
+      entry.replay_until = 0;
+    }
+  }
+
+private:
+  struct reply_entry {
+    time_t replay_until{0};
+    uint32_t address{0};
+    uint16_t port{0};
+    char reply[reservation_message::length]{};
+  };
+
+  static size_t slot_of(const struct sockaddr_in &client) {
+    uint64_t key =
+        ((uint64_t)client.sin_addr.s_addr << 16) ^ client.sin_port;
+    return (size_t)((key * 0x9e3779b97f4a7c15ULL) >>
+                    (64 - DEDUP_CACHE_BITS));
+  }
+
+  time_t window;
+  std::vector<reply_entry> entries;
+};
+
+// Ring of per-slot buffers for the batched mode: slot i holds the i-th
+// datagram of a batch, its sender, the socket's drop count when the
+// datagram was queued and, after processing, the reply to it
+class BufferRing {
+public:
+  explicit BufferRing(size_t slots)
+      : buffers(slots), addresses(slots), controls(slots), read_vectors(slots),
+        send_vectors(slots), read_headers(slots), send_headers(slots) {}
+
+  struct mmsghdr *prepare_read() {
+    for (size_t i = 0; i < buffers.size(); i++) {
+      read_vectors[i] = {buffers[i].get(), BUFFER_SIZE};
+      read_headers[i] = {};
+      read_headers[i].msg_hdr.msg_name = &addresses[i];
+      read_headers[i].msg_hdr.msg_namelen = (socklen_t)sizeof(addresses[i]);
+      read_headers[i].msg_hdr.msg_iov = &read_vectors[i];
+      read_headers[i].msg_hdr.msg_iovlen = 1;
+      read_headers[i].msg_hdr.msg_control = controls[i].data;
+      read_headers[i].msg_hdr.msg_controllen = sizeof(controls[i].data);
+    }
+    replies_count = 0;
+    return read_headers.data();
+  }
+
+  void queue_reply(size_t slot) {
+    send_vectors[replies_count] = {(void *)buffers[slot].get_reply(),
+                                   buffers[slot].get_size()};
+    struct mmsghdr &header = send_headers[replies_count];
+    header = {};
+    header.msg_hdr.msg_name = &addresses[slot];
+    header.msg_hdr.msg_namelen = (socklen_t)sizeof(addresses[slot]);
+    header.msg_hdr.msg_iov = &send_vectors[replies_count];
+    header.msg_hdr.msg_iovlen = 1;
+    replies_count++;
+  }
+
+  [[nodiscard]] size_t size() const { return buffers.size(); }
+
+  Buffer &get_buffer(size_t slot) { return buffers[slot]; }
+
+  [[nodiscard]] const struct sockaddr_in &get_address(size_t slot) const {
+    return addresses[slot];
+  }
+
+  [[nodiscard]] ssize_t get_read_length(size_t slot) const {
+    return read_headers[slot].msg_len;
+  }
+
+  // The SO_RXQ_OVFL count of the slot's socket; the kernel leaves it out
+  // while nothing has been dropped
+  uint32_t get_kernel_drops(size_t slot) {
+    struct msghdr &header = read_headers[slot].msg_hdr;
+    for (struct cmsghdr *control = CMSG_FIRSTHDR(&header); control != nullptr;
+         control = CMSG_NXTHDR(&header, control)) {
+      if (control->cmsg_level == SOL_SOCKET &&
+          control->cmsg_type == SO_RXQ_OVFL) {
+        uint32_t drops;
+        memcpy(&drops, CMSG_DATA(control), sizeof(drops));
+        return drops;
+      }
+    }
+    return 0;
+  }
+
+  struct mmsghdr *get_replies() { return send_headers.data(); }
+
+  [[nodiscard]] size_t get_replies_count() const { return replies_count; }
+
+private:
+  union control_buffer {
+    char data[CMSG_SPACE(sizeof(uint32_t))];
+    struct cmsghdr alignment;
+  };
+
+  std::vector<Buffer> buffers;
+  std::vector<struct sockaddr_in> addresses;
+  std::vector<control_buffer> controls;
+  std::vector<struct iovec> read_vectors;
+  std::vector<struct iovec> send_vectors;
+  std::vector<struct mmsghdr> read_headers;
+  std::vector<struct mmsghdr> send_headers;
+  size_t replies_count{0};
+};
+
+// Minimal io_uring wrapper built directly on the system calls: one
+// submission queue, one completion queue and one provided buffer ring
+class Uring {
+public:
+  Uring() = default;
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+  virtual ~Uring() {
+    if (buffer_ring != nullptr) {
+      munmap(buffer_ring, buffer_ring_size);
+    }
+    if (sqes != nullptr) {
+      munmap(sqes, sqes_size);
+    }
+    if (cq_ring != nullptr && cq_ring != sq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != nullptr) {
+      munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd >= 0) {
+      close(ring_fd);
+    }
+  }
+
+  bool setup(unsigned entries) {
+    struct io_uring_params params {};
+    ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0) {
+      return false;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+
+    sq_ring = map_ring(sq_ring_size, IORING_OFF_SQ_RING);
+    cq_ring = single_mmap ? sq_ring : map_ring(cq_ring_size, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)map_ring(sqes_size, IORING_OFF_SQES);
+    if (sq_ring == nullptr || cq_ring == nullptr || sqes == nullptr) {
+      return false;
+    }
+
+    sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+    sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+    sq_mask = *(unsigned *)(sq_ring + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+    cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+    cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+    cq_mask = *(unsigned *)(cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    sq_local_tail = *sq_tail;
+    return true;
+  }
+
+  // Registers `count` buffers of `size` bytes each, starting at `memory`,
+  // as the provided buffer group `group`. The number must be a power of 2.
+  bool register_buffers(uint16_t group, char *memory, unsigned count,
+                        unsigned size) {
+    buffer_ring_size = count * sizeof(struct io_uring_buf);
+    void *ring = mmap(nullptr, buffer_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+      return false;
+    }
+    // struct io_uring_buf_ring declares its entries with a flexible array
+    // that has a different offset in C++, so the ring is addressed as a plain
+    // array of entries whose first `resv` field is the shared tail
+    buffer_ring = (struct io_uring_buf *)ring;
+
+    struct io_uring_buf_reg registration {};
+    registration.ring_addr = (uint64_t)buffer_ring;
+    registration.ring_entries = count;
+    registration.bgid = group;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING,
+                &registration, 1) < 0) {
+      return false;
+    }
+
+    buffer_mask = count - 1;
+    for (unsigned i = 0; i < count; i++) {
+      provide_buffer(memory + i * size, size, (uint16_t)i);
+    }
+    commit_buffers();
+    return true;
+  }
+
+  void provide_buffer(char *address, unsigned size, uint16_t buffer_id) {
+    struct io_uring_buf &buffer =
+        buffer_ring[buffer_local_tail & buffer_mask];
+    buffer.addr = (uint64_t)address;
+    buffer.len = size;
+    buffer.bid = buffer_id;
+    buffer_local_tail++;
+  }
+
+  void commit_buffers() {
+    __atomic_store_n(&buffer_ring[0].resv, buffer_local_tail, __ATOMIC_RELEASE);
+  }
+
+  // Returns a zeroed submission entry; the queue is sized by the caller so
+  // that it never overflows between two calls to submit_and_wait.
+  struct io_uring_sqe *get_sqe() {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    ENSURE(sq_local_tail - head < sq_entries);
+    unsigned index = sq_local_tail & sq_mask;
+    sq_array[index] = index;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_local_tail++;
+    return sqe;
+  }
+
+  // Submits everything queued so far and waits for at least one completion
+  // in the same system call.
+  void submit_and_wait() {
+    unsigned to_submit = sq_local_tail - *sq_tail;
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    int result;
+    do {
+      result = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, 1,
+                            IORING_ENTER_GETEVENTS, nullptr, 0);
+      to_submit = 0;
+    } while (result < 0 && errno == EINTR);
+    if (result < 0) {
+      PRINT_ERRNO();
+    }
+  }
+
+  template <typename F> void for_each_completion(F handle) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      handle(cqes[head & cq_mask]);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+private:
+  char *map_ring(size_t size, off_t offset) const {
+    void *ring = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    return ring == MAP_FAILED ? nullptr : (char *)ring;
+  }
+
+  int ring_fd{-1};
+  char *sq_ring{nullptr};
+  char *cq_ring{nullptr};
+  size_t sq_ring_size{0};
+  size_t cq_ring_size{0};
+  struct io_uring_sqe *sqes{nullptr};
+  size_t sqes_size{0};
+  unsigned *sq_head{nullptr};
+  unsigned *sq_tail{nullptr};
+  unsigned *sq_array{nullptr};
+  unsigned sq_mask{0};
+  unsigned sq_entries{0};
+  unsigned sq_local_tail{0};
+  unsigned *cq_head{nullptr};
+  unsigned *cq_tail{nullptr};
+  unsigned cq_mask{0};
+  struct io_uring_cqe *cqes{nullptr};
+  struct io_uring_buf *buffer_ring{nullptr};
+  size_t buffer_ring_size{0};
+  unsigned buffer_mask{0};
+  uint16_t buffer_local_tail{0};
+};
+
+static_assert(URING_READ_BUFFER_SIZE > max_request_length);
+
+// State of one request in flight on the io_uring backend: a posted receive
+// and, once it completes, the reply being sent from `message`
+struct uring_slot {
+  Buffer message;
+  // The socket the slot receives from and replies through
+  int socket_fd{-1};
+  struct sockaddr_in read_address {};
+  struct sockaddr_in send_address {};
+  struct iovec read_vector {};
+  struct iovec send_vector {};
+  struct msghdr read_header {};
+  struct msghdr send_header {};
 };
 
 // Class implementing server operations: receiving, sending and processing
 class Server {
 public:
-  Server(ServerParameters parameters, Data data, const Buffer &buffer)
-      : parameters(parameters), data(std::move(data)), buffer(buffer) {}
+  Server(const ServerParameters &parameters, Data &data, size_t worker)
+      : parameters(parameters), data(data),
+        ring(parameters.get_batch_size() > 1 ? parameters.get_batch_size()
+                                              : 0),
+        worker_lock(data.get_worker_lock(worker)),
+        statistics(data.get_statistics(worker)),
+        log(data.get_log_ring(worker)),
+        replies(parameters.get_dedup_window()),
+        batch_order(ring.size()), worker(worker) {}
 
   virtual ~Server() {
-    CHECK_ERRNO(close(socket_fd));
+    for (int socket_fd : socket_fds) {
+      CHECK_ERRNO(close(socket_fd));
+    }
+    if (epoll_fd >= 0) {
+      CHECK_ERRNO(close(epoll_fd));
+    }
+    if (timer_fd >= 0) {
+      CHECK_ERRNO(close(timer_fd));
+    }
     if (debug) {
       fprintf(stderr, "Server closed\n");
     }
   }
 
 private:
-  [[nodiscard]] char *get_ip() const {
-    return inet_ntoa(client_address.sin_addr);
+  // Every listening address gets a socket. With several workers every one
+  // of them binds its own sockets to the same addresses and the kernel
+  // spreads the clients between them.
+  void bind_sockets() {
+    for (const struct sockaddr_in &server_address :
+         parameters.get_listen_addresses()) {
+      int socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+      ENSURE(socket_fd > 0);
+
+      if (parameters.get_workers() > 1) {
+        int reuse_port = 1;
+        CHECK_ERRNO(setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT,
+                               &reuse_port, (socklen_t)sizeof(reuse_port)));
+      }
+      // Batches come with the count of datagrams the socket dropped
+      if (ring.size() > 0) {
+        int report_drops = 1;
+        CHECK_ERRNO(setsockopt(socket_fd, SOL_SOCKET, SO_RXQ_OVFL,
+                               &report_drops, (socklen_t)sizeof(report_drops)));
+      }
+
+      CHECK_ERRNO(bind(socket_fd, (const struct sockaddr *)&server_address,
+                       (socklen_t)sizeof(server_address)));
+      socket_fds.push_back(socket_fd);
+      socket_drops.push_back(0);
+      if (debug) {
+        fprintf(stderr, "Listening on %s:%u\n",
+                inet_ntoa(server_address.sin_addr),
+                ntohs(server_address.sin_port));
+      }
+    }
   }
 
-  void bind_socket() {
-    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    ENSURE(socket_fd > 0);
+  // time() may read a coarse clock that lags behind the one of the timer,
+  // so the timer's own clock decides what has expired when it goes off
+  static time_t realtime_now() {
+    struct timespec now {};
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec;
+  }
 
-    struct sockaddr_in server_address {};
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_address.sin_port = htons(parameters.get_port());
+  // A reservation expires once the time passes its expiration_time, so the
+  // timer goes off at the next second, and never in the past, which would
+  // make it go off again at once. Expiration time 0 disarms it.
+  void arm_expiry_timer(time_t expiration_time) {
+    struct itimerspec deadline {};
+    if (expiration_time != 0) {
+      deadline.it_value.tv_sec =
+          std::max(expiration_time + 1, realtime_now() + 1);
+    }
+    CHECK_ERRNO(
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &deadline, nullptr));
+    timer_armed_for = expiration_time;
+  }
 
-    CHECK_ERRNO(bind(socket_fd, (struct sockaddr *)&server_address,
-                     (socklen_t)sizeof(server_address)));
+  // Called with the worker lock held when the expiry timer went off. The
+  // timer is set again for the next reservation of any worker, so every
+  // reservation is released on time by some worker even when no datagram
+  // arrives.
+  void release_expired() {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+      ENSURE(errno == EAGAIN);
+    }
+    time_after_read = realtime_now();
+    uint64_t start = monotonic_ns();
+    size_t expired = data.remove_expired_reservations(time_after_read);
+    statistics.record_expiry(expired, monotonic_ns() - start);
+    arm_expiry_timer(data.next_expiration());
   }
 
-  void send_message() {
+  void send_message(int socket_fd) {
     auto address_length = (socklen_t)sizeof(client_address);
     int flags = 0;
-    sent_length = sendto(socket_fd, buffer.get(), buffer.get_size(), flags,
+    sent_length = sendto(socket_fd, buffer.get_reply(), buffer.get_size(), flags,
                          (struct sockaddr *)&client_address, address_length);
     ENSURE(sent_length == (ssize_t)buffer.get_size());
   }
 
-  void read_message() {
+  // Sockets stay blocking for the replies, but are only read when epoll
+  // says so; returns false when nothing is queued after all.
+  bool read_message(int socket_fd) {
     auto address_length = (socklen_t)sizeof(client_address);
-    int flags = 0;
+    int flags = MSG_DONTWAIT;
     errno = 0;
     read_length = recvfrom(socket_fd, buffer.get(), BUFFER_SIZE, flags,
                            (struct sockaddr *)&client_address, &address_length);
     if (read_length < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return false;
+      }
       PRINT_ERRNO();
     }
     time_after_read = time(nullptr);
-    if (debug) {
-      fprintf(stderr, "Received message from [%s:%d].\n", get_ip(),
-              parameters.get_port());
+    return true;
+  }
+
+  // Takes every datagram that is already queued, up to the batch size, in
+  // a single recvmmsg call; returns false when there is none.
+  bool read_batch(size_t socket) {
+    int socket_fd = socket_fds[socket];
+    errno = 0;
+    int received = recvmmsg(socket_fd, ring.prepare_read(), ring.size(),
+                            MSG_DONTWAIT, nullptr);
+    if (received < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return false;
+      }
+      PRINT_ERRNO();
     }
+    batch_length = (size_t)received;
+    time_after_read = time(nullptr);
+    // The last datagram was queued last, so it has the latest count
+    if (batch_length > 0) {
+      uint32_t drops = ring.get_kernel_drops(batch_length - 1);
+      increment(statistics.kernel_drops,
+                (uint32_t)(drops - socket_drops[socket]));
+      socket_drops[socket] = drops;
+    }
+    return true;
   }
 
-  bool first_validate() {
-    uint8_t message_id = buffer.get_message_id();
-    return ((message_id == 1) && (read_length == GET_EVENTS_MSG_LENGTH)) ||
-           ((message_id == 3) && (read_length == GET_RESERVATION_MSG_LENGTH)) ||
-           ((message_id == 5) && (read_length == GET_TICKETS_MSG_LENGTH));
+  void send_batch(int socket_fd) {
+    struct mmsghdr *replies = ring.get_replies();
+    size_t replies_count = ring.get_replies_count();
+    size_t sent = 0;
+    while (sent < replies_count) {
+      errno = 0;
+      int result = sendmmsg(socket_fd, replies + sent,
+                            (unsigned int)(replies_count - sent), 0);
+      if (result < 0) {
+        PRINT_ERRNO();
+      }
+      for (int i = 0; i < result; i++) {
+        ENSURE(replies[sent + i].msg_len ==
+               replies[sent + i].msg_hdr.msg_iov->iov_len);
+      }
+      sent += result;
+    }
   }
 
-  void show_information() {
-    uint8_t sent_message_id = buffer.get_message_id();
-    if (debug) {
-      if (sent_message_id != BAD_REQUEST) {
-        fprintf(stderr,
-                "Server followed the instructions from received message.\n");
-      } else {
-        fprintf(stderr, "Server received the message with incorrect data.\n");
+  // Only pushes a record, so the worker never waits for the log file.
+  // The id is taken from the reply: RESERVATION, TICKETS and BAD_REQUEST
+  // all start with the reservation_id or event_id they are about.
+  void log_request(const struct sockaddr_in &client, uint64_t time_ns,
+                   uint8_t message_id, const Buffer *reply,
+                   BAD_REQUEST_REASON reason) {
+    static_assert(reservation_message::offset<0>() ==
+                      bad_request_message::offset<0>() &&
+                  tickets_message::offset<0>() ==
+                      bad_request_message::offset<0>());
+    log_record record{};
+    record.time_ns = time_ns;
+    record.address = client.sin_addr.s_addr;
+    record.port = client.sin_port;
+    record.message_id = message_id;
+    record.reason = (uint8_t)reason;
+    if (reply != nullptr) {
+      const char *message = reply->get_reply();
+      record.reply_id = (uint8_t)message[0];
+      if (record.reply_id != EVENTS) {
+        record.id = bad_request_message::get<0>(message);
       }
-      fprintf(stderr, "Server sent message with message_id = %d.\n",
-              sent_message_id);
     }
+    log->push(record);
   }
 
-  void execute_command() {
-    data.remove_expired_reservations(time_after_read);
-    if (debug && !first_validate()) {
-      fprintf(stderr, "Received message does not have correct parameters.\n"
-                      "Server ignored the message\n");
-      return;
+  // Processes the message in place; returns whether a reply was put into
+  // the buffer. Messages with a wrong length or type are never answered.
+  // Every packet is counted and timed in the worker's statistics and, if
+  // requests are logged, logged with its client.
+  bool execute_command(Buffer &message, ssize_t length,
+                       const struct sockaddr_in &client) {
+    uint64_t expiry_start = monotonic_ns();
+    // Requests over their client's limit are dropped before anything else
+    if (data.is_rate_limited() && length > 0 &&
+        is_valid_request(message.get(), (size_t)length)) {
+      size_t type = worker_statistics::request_type(message.get_message_id());
+      if (!data.admit_request(client.sin_addr.s_addr, type, expiry_start)) {
+        increment(statistics.rate_limited[type]);
+        return false;
+      }
+    }
+    size_t expired = data.remove_expired_reservations(time_after_read);
+    uint64_t start = monotonic_ns();
+    statistics.record_expiry(expired, start - expiry_start);
+    if (length < 0 || !is_valid_request(message.get(), (size_t)length)) {
+      increment(statistics.malformed);
+      if (log != nullptr) {
+        log_request(client, start, length > 0 ? message.get_message_id() : 0,
+                    nullptr, NOT_REFUSED);
+      }
+      return false;
     }
 
-    switch (buffer.get_message_id()) {
+    uint8_t message_id = message.get_message_id();
+    BAD_REQUEST_REASON reason = NOT_REFUSED;
+    if (replies.is_enabled() && message_id != GET_RESERVATION) {
+      replies.forget(client);
+    }
+    switch (message_id) {
     case GET_EVENTS:
-      buffer.insert_events(data);
+      message.insert_events(data, worker);
       break;
 
     case GET_RESERVATION:
-      buffer.try_to_insert_reservation(data, time_after_read,
-                                       parameters.get_timeout());
+      if (replies.is_enabled() &&
+          replies.replay(data, client, time_after_read, message)) {
+        increment(statistics.replayed);
+        break;
+      }
+      reason = message.try_to_insert_reservation(data, time_after_read,
+                                                 parameters.get_timeout());
+      if (replies.is_enabled() && reason == NOT_REFUSED) {
+        replies.remember(client, time_after_read, message);
+      } else if (replies.is_enabled()) {
+        replies.forget(client);
+      }
       break;
 
     case GET_TICKETS:
-      buffer.try_to_insert_tickets(data, time_after_read);
+      reason = message.try_to_insert_tickets(data, time_after_read);
       break;
 
     default:
-      if (debug) {
-        fprintf(stderr, "Message has an unexpected type.\n");
+      return false;
+    }
+    statistics.record_request(message_id, reason, monotonic_ns() - start);
+    // Whoever makes a reservation makes sure it is released on time
+    if (message_id == GET_RESERVATION && reason == NOT_REFUSED &&
+        timer_armed_for == 0) {
+      arm_expiry_timer(time_after_read + parameters.get_timeout());
+    }
+    if (log != nullptr) {
+      log_request(client, start, message_id, &message, reason);
+    }
+    return true;
+  }
+
+  void execute_slot(size_t slot) {
+    if (execute_command(ring.get_buffer(slot), ring.get_read_length(slot),
+                        ring.get_address(slot))) {
+      ring.queue_reply(slot);
+    }
+  }
+
+  static size_t priority_class(Buffer &message, ssize_t length) {
+    if (length < 0 || !is_valid_request(message.get(), (size_t)length)) {
+      return PRIORITY_CLASSES - 1;
+    }
+    switch (message.get_message_id()) {
+    case GET_TICKETS:
+      return 0;
+    case GET_RESERVATION:
+      return 1;
+    default:
+      return 2;
+    }
+  }
+
+  // Batches are processed in the order they were received, so the state in
+  // data evolves exactly as if the datagrams were handled one by one. In
+  // the priority mode GET_TICKETS go first, then GET_RESERVATION, then
+  // GET_EVENTS, each kind in the order received, and GET_EVENTS past the
+  // shed threshold are dropped.
+  void execute_batch() {
+    size_t threshold = (size_t)parameters.get_shed_threshold();
+    if (threshold == 0) {
+      for (size_t i = 0; i < batch_length; i++) {
+        execute_slot(i);
+      }
+      return;
+    }
+
+    size_t starts[PRIORITY_CLASSES + 1]{};
+    for (size_t i = 0; i < batch_length; i++) {
+      starts[priority_class(ring.get_buffer(i), ring.get_read_length(i)) +
+             1]++;
+    }
+    for (size_t i = 1; i <= PRIORITY_CLASSES; i++) {
+      starts[i] += starts[i - 1];
+    }
+    size_t events_start = std::max(starts[2], threshold);
+    size_t events_end = starts[3];
+    for (size_t i = 0; i < batch_length; i++) {
+      batch_order[starts[priority_class(ring.get_buffer(i),
+                                        ring.get_read_length(i))]++] = i;
+    }
+
+    for (size_t position = 0; position < batch_length; position++) {
+      if (position >= events_start && position < events_end) {
+        increment(statistics.shed);
+      } else {
+        execute_slot(batch_order[position]);
       }
     }
   }
 
-public:
-  void run() {
-    bind_socket();
-    if (debug) {
-      fprintf(stderr, "Listening on port %u\n", parameters.get_port());
+  enum URING_OPERATION {
+    URING_READ = 0,
+    URING_SEND = 1,
+  };
+
+  // user_data of the poll on the expiry timer, which is no slot's
+  static constexpr uint64_t URING_TIMER = UINT64_MAX;
+
+  void post_uring_timer_poll(Uring &uring) {
+    struct io_uring_sqe *sqe = uring.get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = timer_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_TIMER;
+  }
+
+  void post_uring_read(Uring &uring, std::vector<uring_slot> &slots,
+                       size_t slot) {
+    uring_slot &s = slots[slot];
+    s.read_vector = {nullptr, URING_READ_BUFFER_SIZE};
+    s.read_header = {};
+    s.read_header.msg_name = &s.read_address;
+    s.read_header.msg_namelen = (socklen_t)sizeof(s.read_address);
+    s.read_header.msg_iov = &s.read_vector;
+    s.read_header.msg_iovlen = 1;
+
+    struct io_uring_sqe *sqe = uring.get_sqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = s.socket_fd;
+    sqe->addr = (uint64_t)&s.read_header;
+    sqe->len = 1;
+    // MSG_TRUNC makes the result the real datagram length, so oversized
+    // messages are still rejected by their length
+    sqe->msg_flags = MSG_TRUNC;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = slot * 2 + URING_READ;
+  }
+
+  // The send and the receive that re-arms the slot are linked, so both are
+  // submitted in the same round trip and the receive cannot overwrite the
+  // slot before its reply has left.
+  void post_uring_send(Uring &uring, std::vector<uring_slot> &slots,
+                       size_t slot) {
+    uring_slot &s = slots[slot];
+    s.send_address = s.read_address;
+    s.send_vector = {(void *)s.message.get_reply(), s.message.get_size()};
+    s.send_header = {};
+    s.send_header.msg_name = &s.send_address;
+    s.send_header.msg_namelen = (socklen_t)sizeof(s.send_address);
+    s.send_header.msg_iov = &s.send_vector;
+    s.send_header.msg_iovlen = 1;
+
+    struct io_uring_sqe *sqe = uring.get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = s.socket_fd;
+    sqe->addr = (uint64_t)&s.send_header;
+    sqe->len = 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = slot * 2 + URING_SEND;
+    post_uring_read(uring, slots, slot);
+  }
+
+  void handle_uring_read(Uring &uring, std::vector<uring_slot> &slots,
+                         char *read_buffers, size_t slot,
+                         const struct io_uring_cqe &cqe) {
+    if (cqe.res < 0) {
+      if (cqe.res != -ECANCELED && cqe.res != -ENOBUFS) {
+        errno = -cqe.res;
+        PRINT_ERRNO();
+      }
+      post_uring_read(uring, slots, slot);
+      return;
+    }
+
+    auto buffer_id = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    char *data_read = read_buffers + buffer_id * URING_READ_BUFFER_SIZE;
+    uring_slot &s = slots[slot];
+    memcpy(s.message.get(), data_read,
+           std::min(cqe.res, URING_READ_BUFFER_SIZE));
+    uring.provide_buffer(data_read, URING_READ_BUFFER_SIZE, buffer_id);
+
+    if (execute_command(s.message, cqe.res, s.read_address)) {
+      post_uring_send(uring, slots, slot);
+    } else {
+      post_uring_read(uring, slots, slot);
+    }
+  }
+
+  // Keeps one receive posted per slot, with the slots of every socket,
+  // and a poll on the expiry timer; returns false when io_uring or provided
+  // buffer rings are not available, without touching the sockets.
+  bool run_uring() {
+    size_t slots_count = (parameters.get_batch_size() > 1
+                              ? parameters.get_batch_size()
+                              : URING_DEFAULT_SLOTS) *
+                         socket_fds.size();
+    unsigned buffers_count = 1;
+    while (buffers_count < slots_count) {
+      buffers_count *= 2;
+    }
+
+    Uring uring;
+    std::vector<char> read_buffers(buffers_count * URING_READ_BUFFER_SIZE);
+    if (!uring.setup(2 * buffers_count + 1) ||
+        !uring.register_buffers(URING_BUFFER_GROUP, read_buffers.data(),
+                                buffers_count, URING_READ_BUFFER_SIZE)) {
+      return false;
+    }
+
+    std::vector<uring_slot> slots(slots_count);
+    for (size_t i = 0; i < slots_count; i++) {
+      slots[i].socket_fd = socket_fds[i % socket_fds.size()];
+      post_uring_read(uring, slots, i);
+    }
+    post_uring_timer_poll(uring);
+
+    while (true) {
+      uring.submit_and_wait();
+      time_after_read = time(nullptr);
+      std::lock_guard<std::mutex> lock(worker_lock);
+      uring.for_each_completion([&](const struct io_uring_cqe &cqe) {
+        size_t slot = cqe.user_data / 2;
+        if (cqe.user_data == URING_TIMER) {
+          release_expired();
+          post_uring_timer_poll(uring);
+        } else if (cqe.user_data % 2 == URING_READ) {
+          handle_uring_read(uring, slots, read_buffers.data(), slot, cqe);
+        } else {
+          ENSURE(cqe.res == (int)slots[slot].message.get_size());
+        }
+      });
+      // The replies posted above are only submitted by the next call
+      data.commit_journal();
+      uring.commit_buffers();
+    }
+  }
+
+  void serve_batch(size_t socket) {
+    if (!read_batch(socket)) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(worker_lock);
+      execute_batch();
+      data.commit_journal();
+    }
+    send_batch(socket_fds[socket]);
+  }
+
+  void serve_datagrams(int socket_fd) {
+    for (int i = 0; i < SOCKET_READS_PER_WAKEUP && read_message(socket_fd);
+         i++) {
+      std::unique_lock<std::mutex> lock(worker_lock);
+      bool replied = execute_command(buffer, read_length, client_address);
+      data.commit_journal();
+      lock.unlock();
+      if (replied) {
+        send_message(socket_fd);
+      }
+    }
+  }
+
+  // Waits on all sockets and the expiry timer at once. A ready socket gives
+  // one batch, or up to SOCKET_READS_PER_WAKEUP datagrams without batching,
+  // before the others get their turn.
+  void run_sockets() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ENSURE(epoll_fd >= 0);
+    // Sockets are watched under their index and the timer after them
+    for (size_t i = 0; i <= socket_fds.size(); i++) {
+      struct epoll_event event {};
+      event.events = EPOLLIN;
+      event.data.u64 = i;
+      int fd = i < socket_fds.size() ? socket_fds[i] : timer_fd;
+      CHECK_ERRNO(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event));
     }
 
+    struct epoll_event events[EPOLL_MAX_EVENTS];
     while (true) {
-      read_message();
-      execute_command();
-      show_information();
-      send_message();
+      int ready = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, -1);
+      if (ready < 0) {
+        ENSURE(errno == EINTR);
+        continue;
+      }
+      for (int i = 0; i < ready; i++) {
+        size_t index = events[i].data.u64;
+        if (index == socket_fds.size()) {
+          std::lock_guard<std::mutex> lock(worker_lock);
+          release_expired();
+          data.commit_journal();
+        } else if (ring.size() > 0) {
+          serve_batch(index);
+        } else {
+          serve_datagrams(socket_fds[index]);
+        }
+      }
+    }
+  }
+
+public:
+  void run() {
+    bind_sockets();
+    timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    ENSURE(timer_fd >= 0);
+    // Reservations restored at startup are nobody's yet
+    arm_expiry_timer(data.next_expiration());
+
+    // io_uring completes datagrams one by one, so there are no batches
+    // to reorder in the priority mode
+    if (parameters.get_io_backend() == URING_BACKEND &&
+        parameters.get_shed_threshold() > 0) {
+      fprintf(stderr, "Priority mode uses the sockets backend\n");
+    } else if (parameters.get_io_backend() == URING_BACKEND) {
+      run_uring();
+      fprintf(stderr, "io_uring is not available, using sockets backend\n");
     }
+    run_sockets();
   }
 
 private:
-  ServerParameters parameters;
-  Data data;
+  const ServerParameters &parameters;
+  Data &data;
   Buffer buffer;
+  BufferRing ring;
+  // Held while requests are handled, never while waiting for them
+  std::mutex &worker_lock;
+  worker_statistics &statistics;
+  LogRing *log;
+  ReservationReplies replies;
+  // Slots of the batch in the order they are served in the priority mode
+  std::vector<size_t> batch_order;
+  size_t worker;
   time_t time_after_read{time(nullptr)};
   ssize_t read_length{0};
   ssize_t sent_length{0};
-  int socket_fd{};
+  size_t batch_length{0};
+  std::vector<int> socket_fds;
+  // Last SO_RXQ_OVFL count seen on each socket
+  std::vector<uint32_t> socket_drops;
+  int epoll_fd{-1};
+  // Set to go off when the reservation expiring at timer_armed_for does;
+  // timer_armed_for is 0 while the timer is not set
+  int timer_fd{-1};
+  time_t timer_armed_for{0};
   struct sockaddr_in client_address {};
 };
 
+// Benchmarks and tests include this file with TICKET_SERVER_NO_MAIN defined
+#ifndef TICKET_SERVER_NO_MAIN
+// SIGUSR1 writes a snapshot and SIGTERM writes one and stops the server.
+// The signals are blocked before the workers start, so only this thread
+// receives them and the workers are never interrupted.
+void start_snapshot_thread(Data &data) {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGTERM);
+  ENSURE(pthread_sigmask(SIG_BLOCK, &signals, nullptr) == 0);
+  std::thread([&data, signals]() {
+    while (true) {
+      int signal_number;
+      ENSURE(sigwait(&signals, &signal_number) == 0);
+      data.write_snapshot();
+      if (signal_number == SIGTERM) {
+        exit(EXIT_SUCCESS);
+      }
+    }
+  }).detach();
+}
+
+// Started after the snapshot thread, so it keeps the signals blocked too.
+void start_statistics_thread(Data &data) {
+  std::thread([&data]() {
+    while (true) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(STATS_INTERVAL_MS));
+      data.write_statistics();
+    }
+  }).detach();
+}
+
+// Writes out the logged requests every LOG_FLUSH_INTERVAL_MS milliseconds.
+void start_log_thread(Data &data) {
+  std::thread([&data]() {
+    while (true) {
+      std::this_thread::sleep_for(
+          std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+      data.flush_log();
+    }
+  }).detach();
+}
+
 int main(int argc, char *argv[]) {
   ServerParameters parameters = ServerParameters(argc, argv);
   Data data = Data(parameters);
-  Buffer shared_buffer = Buffer();
-  Server udp_server = Server(parameters, data, shared_buffer);
+  if (parameters.get_snapshot_path() != nullptr) {
+    start_snapshot_thread(data);
+  }
+  if (parameters.get_stats_path() != nullptr) {
+    start_statistics_thread(data);
+  }
+  if (data.is_logging()) {
+    start_log_thread(data);
+  }
+
+  std::vector<std::thread> workers;
+  for (int i = 1; i < parameters.get_workers(); i++) {
+    workers.emplace_back([&parameters, &data, i]() {
+      Server worker = Server(parameters, data, i);
+      worker.run();
+    });
+  }
+
+  Server udp_server = Server(parameters, data, 0);
   udp_server.run();
 }
+#endif
@@ -0,0 +1,174 @@
+// Checks that a warmed up server handles GET_EVENTS, GET_RESERVATION and
+// GET_TICKETS without a single heap allocation.
+// Build and run:
+//   g++ -std=c++17 -O2 -o ticket_server_alloc_test ticket_server_alloc_test.cpp
+//   ./ticket_server_alloc_test
+// Exits with 1 if any configuration allocates in the steady state.
+#define TICKET_SERVER_NO_MAIN
+#include "ticket_server.cpp"
+
+#include <new>
+
+// GCC pairs the replaced operators below with their inlined callers and
+// reports a mismatch between malloc and the library's operator delete
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+#define TEST_EVENTS_FILE "/tmp/ticket_server_alloc_test_events"
+#define TEST_ARCHIVE_FILE "/tmp/ticket_server_alloc_test_archive"
+#define TEST_JOURNAL_FILE "/tmp/ticket_server_alloc_test_journal"
+#define TEST_EVENTS 10
+#define TEST_TIMEOUT 2
+#define WARM_UP_CYCLES 20000
+#define MEASURED_CYCLES 20000
+// Requests per simulated second, so reservations keep expiring
+#define CYCLES_PER_SECOND 64
+
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size) {
+  allocations++;
+  void *memory = malloc(size == 0 ? 1 : size);
+  if (memory == nullptr) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  allocations++;
+  void *memory = nullptr;
+  if (posix_memalign(&memory, std::max(sizeof(void *), (size_t)alignment),
+                     size == 0 ? 1 : size) != 0) {
+    throw std::bad_alloc();
+  }
+  return memory;
+}
+
+void *operator new[](size_t size, std::align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void operator delete(void *memory) noexcept { free(memory); }
+void operator delete[](void *memory) noexcept { free(memory); }
+void operator delete(void *memory, size_t) noexcept { free(memory); }
+void operator delete[](void *memory, size_t) noexcept { free(memory); }
+void operator delete(void *memory, std::align_val_t) noexcept { free(memory); }
+void operator delete[](void *memory, std::align_val_t) noexcept {
+  free(memory);
+}
+void operator delete(void *memory, size_t, std::align_val_t) noexcept {
+  free(memory);
+}
+void operator delete[](void *memory, size_t, std::align_val_t) noexcept {
+  free(memory);
+}
+
+// One GET_EVENTS, one GET_RESERVATION and one GET_TICKETS, handled the
+// way Server::execute_command does it.
+class RequestCycle {
+public:
+  RequestCycle(Data &data, bool collect_tickets)
+      : data(data), collect_tickets(collect_tickets) {}
+
+  void run(size_t cycle) {
+    time_t now = start_time + (time_t)(cycle / CYCLES_PER_SECOND);
+    worker_statistics &statistics = data.get_statistics(0);
+    uint64_t start = monotonic_ns();
+    statistics.record_expiry(data.remove_expired_reservations(now),
+                             monotonic_ns() - start);
+
+    get_events_message::encode(buffer.get());
+    buffer.insert_events(data, 0);
+    ENSURE(buffer.get_reply()[0] == (char)EVENTS);
+    statistics.record_request(GET_EVENTS, NOT_REFUSED, monotonic_ns() - start);
+
+    char *message = buffer.get();
+    get_reservation_message::encode(message, (uint32_t)(cycle % TEST_EVENTS),
+                                    1);
+    statistics.record_request(
+        GET_RESERVATION,
+        buffer.try_to_insert_reservation(data, now, TEST_TIMEOUT),
+        monotonic_ns() - start);
+    ENSURE(buffer.get_reply()[0] == (char)RESERVATION);
+    // GET_TICKETS for the reservation just made. Without an archive
+    // achieved reservations stay in memory for good, so then the cookie is
+    // spoiled and every reservation expires instead.
+    char cookie[COOKIE_SIZE];
+    memcpy(cookie, reservation_message::get<3>(message), COOKIE_SIZE);
+    if (!collect_tickets) {
+      cookie[0] = cookie[0] == '!' ? '"' : '!';
+    }
+    get_tickets_message::encode(message, reservation_message::get<0>(message),
+                                cookie);
+    statistics.record_request(GET_TICKETS,
+                              buffer.try_to_insert_tickets(data, now),
+                              monotonic_ns() - start);
+    ENSURE(buffer.get_reply()[0] ==
+           (char)(collect_tickets ? TICKETS : BAD_REQUEST));
+
+    data.commit_journal();
+  }
+
+private:
+  Data &data;
+  Buffer buffer;
+  bool collect_tickets;
+  time_t start_time{time(nullptr)};
+};
+
+static bool check_steady_state(const char *name,
+                               std::vector<const char *> flags) {
+  std::vector<string> arguments = {"ticket_server_alloc_test", "-f",
+                                   TEST_EVENTS_FILE};
+  arguments.insert(arguments.end(), flags.begin(), flags.end());
+  std::vector<char *> argv;
+  for (string &argument : arguments) {
+    argv.push_back(argument.data());
+  }
+  unlink(TEST_ARCHIVE_FILE);
+  unlink(TEST_JOURNAL_FILE);
+  optind = 1;
+  ServerParameters parameters((int)argv.size(), argv.data());
+  Data data(parameters);
+  RequestCycle cycle(data, parameters.get_archive_path() != nullptr);
+
+  for (size_t i = 0; i < WARM_UP_CYCLES; i++) {
+    cycle.run(i);
+  }
+  allocations = 0;
+  for (size_t i = WARM_UP_CYCLES; i < WARM_UP_CYCLES + MEASURED_CYCLES; i++) {
+    cycle.run(i);
+  }
+  size_t counted = allocations;
+
+  printf("%s: %zu allocations in %d request cycles\n", name, counted,
+         MEASURED_CYCLES);
+  return counted == 0;
+}
+
+int main() {
+  FILE *events = fopen(TEST_EVENTS_FILE, "w");
+  ENSURE(events != nullptr);
+  for (int i = 0; i < TEST_EVENTS; i++) {
+    fprintf(events, "event %d\n%d\n", i, UINT16_MAX);
+  }
+  fclose(events);
+
+  bool passed = check_steady_state("default", {});
+  passed &= check_steady_state("hmac cookies", {"-c", "hmac"});
+  passed &= check_steady_state("archive", {"-a", TEST_ARCHIVE_FILE});
+  passed &= check_steady_state(
+      "archive, journal and 4 workers",
+      {"-a", TEST_ARCHIVE_FILE, "-j", TEST_JOURNAL_FILE, "-w", "4"});
+
+  unlink(TEST_EVENTS_FILE);
+  unlink(TEST_ARCHIVE_FILE);
+  unlink(TEST_JOURNAL_FILE);
+  if (!passed) {
+    fprintf(stderr, "Requests allocate memory in the steady state\n");
+    return 1;
+  }
+  return 0;
+}
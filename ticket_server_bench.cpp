@@ -0,0 +1,727 @@
+// Microbenchmarks of the ticket server internals, without any sockets.
+// Build and run:
+//   g++ -std=c++17 -O2 -DNDEBUG -o ticket_server_bench ticket_server_bench.cpp
+//   ./ticket_server_bench [cookies] [catalog] [startup] [journal] [soak]
+//                         [protocol] [tickets] [core]
+// Every case prints one JSON line, so results can be compared across commits.
+#define TICKET_SERVER_NO_MAIN
+#include "ticket_server.cpp"
+
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <random>
+
+// The imperative server, for the core cases: its headers are all included
+// above, so only its own definitions land in the namespace
+#undef PRINT_ERRNO
+#undef CHECK_ERRNO
+#undef ENSURE
+namespace imperative {
+#include "ticket_server_imperative.cpp"
+}
+
+#define BENCH_EXPIRATION_TIME 1700000000
+#define SOAK_RESERVATIONS 10000000
+#define SOAK_SAMPLE_EVERY 1000000
+#define SOAK_EVENTS 200
+#define CATALOG_EVENTS 300000
+#define BENCH_EVENTS_FILE "/tmp/ticket_server_bench_events"
+#define SOAK_ARCHIVE_FILE "/tmp/ticket_server_bench_archive"
+#define JOURNAL_FILE "/tmp/ticket_server_bench_journal"
+#define JOURNAL_BATCHES 200
+#define LARGE_RESERVATION_TICKETS 9000
+#define COOKIE_MAP_COOKIES 65536
+#define COOKIE_MAP_BYTES (COOKIE_MAP_COOKIES * 80 + 160)
+#define CORE_LIVE_RESERVATIONS 1000000
+#define CORE_EVENT_TICKETS UINT16_MAX
+
+static volatile char sink;
+
+template <typename F>
+void run_benchmark(const char *name, size_t iterations, F operation) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++) {
+    operation(i);
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns_per_op =
+      std::chrono::duration<double, std::nano>(end - start).count() /
+      (double)iterations;
+  printf("{\"benchmark\": \"%s\", \"iterations\": %zu, \"ns_per_op\": %.1f}\n",
+         name, iterations, ns_per_op);
+  fflush(stdout);
+}
+
+// Random cookies are generated once and stored, so verifying one is a
+// comparison with the stored copy; hmac cookies are not stored and are recomputed both
+// when the RESERVATION is sent and when GET_TICKETS is checked.
+static void bench_cookies() {
+  run_benchmark("cookie_random_generate", 1000000, [](size_t) {
+    char cookie[COOKIE_SIZE];
+    reservation::generate_cookie(cookie);
+    sink = cookie[0];
+  });
+
+  char stored_cookie[COOKIE_SIZE];
+  reservation::generate_cookie(stored_cookie);
+  char received_cookie[COOKIE_SIZE];
+  memcpy(received_cookie, stored_cookie, COOKIE_SIZE);
+  run_benchmark("cookie_random_verify", 1000000, [&](size_t) {
+    sink = (char)CookieSigner::equal(stored_cookie, received_cookie);
+  });
+
+  CookieSigner signer;
+  run_benchmark("cookie_hmac_generate", 1000000, [&](size_t i) {
+    char cookie[COOKIE_SIZE];
+    signer.sign(1000000 + i, 0, BENCH_EXPIRATION_TIME, cookie);
+    sink = cookie[0];
+  });
+
+  char signed_cookie[COOKIE_SIZE];
+  signer.sign(1000000, 0, BENCH_EXPIRATION_TIME, signed_cookie);
+  run_benchmark("cookie_hmac_verify", 1000000, [&](size_t) {
+    char expected_cookie[COOKIE_SIZE];
+    signer.sign(1000000, 0, BENCH_EXPIRATION_TIME, expected_cookie);
+    sink = (char)CookieSigner::equal(expected_cookie, signed_cookie);
+  });
+}
+
+static void write_events_file(int count, int tickets) {
+  FILE *events = fopen(BENCH_EVENTS_FILE, "w");
+  ENSURE(events != nullptr);
+  for (int i = 0; i < count; i++) {
+    fprintf(events, "bench event %d\n%d\n", i, tickets);
+  }
+  fclose(events);
+}
+
+// Lookups of random events in a catalog of CATALOG_EVENTS, and replies to
+// GET_EVENTS, which only read the first events of the catalog.
+static void bench_catalog() {
+  write_events_file(CATALOG_EVENTS, 100);
+  char program[] = "ticket_server_bench";
+  char file_flag[] = "-f";
+  char events_path[] = BENCH_EVENTS_FILE;
+  char *argv[] = {program, file_flag, events_path};
+  optind = 1;
+  ServerParameters parameters(3, argv);
+  Data data(parameters);
+
+  std::vector<int> event_ids(1 << 16);
+  uint32_t state = 12345;
+  for (int &event_id : event_ids) {
+    state = state * 1103515245 + 12345;
+    event_id = (int)(state % CATALOG_EVENTS);
+  }
+  run_benchmark("catalog_validate_reservation", 10000000, [&](size_t i) {
+    sink = (char)data.check_reservation(event_ids[i & 0xffff], 1);
+  });
+
+  Buffer buffer;
+  run_benchmark("catalog_insert_events", 100000, [&](size_t) {
+    buffer.insert_events(data, 0);
+    sink = buffer.get_reply()[0];
+  });
+  unlink(BENCH_EVENTS_FILE);
+}
+
+// Events files like the generated ones of the tests: descriptions of
+// varying length, each followed by its ticket count.
+static void write_generated_events_file(const char *path, int count) {
+  FILE *events = fopen(path, "w");
+  ENSURE(events != nullptr);
+  uint32_t state = 12345;
+  for (int i = 0; i < count; i++) {
+    state = state * 1103515245 + 12345;
+    int padding = (int)(state >> 16) % 60;
+    fprintf(events, "Event number %d %.*s\n%u\n", i, padding,
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJKLMNOPQRSTUVWXYZABCDEFGHIJ",
+            (state >> 8) % 1000);
+  }
+  fclose(events);
+}
+
+// The line by line loader the catalog replaced, kept as the baseline.
+static size_t load_serially(const char *path) {
+  std::map<int, std::pair<string, uint16_t>> events;
+  FILE *fp = fopen(path, "r");
+  char description[MAX_DESCRIPTION_SIZE + 2];
+  char tickets_str[MAX_DESCRIPTION_SIZE + 2];
+  int event_id = 0;
+  while (fgets(description, MAX_DESCRIPTION_SIZE + 2, fp) &&
+         fgets(tickets_str, MAX_DESCRIPTION_SIZE + 2, fp)) {
+    int description_length = (int)strlen(description) - 1;
+    events.try_emplace(event_id++, string(description, description_length),
+                       (uint16_t)strtoul(tickets_str, nullptr, 10));
+  }
+  fclose(fp);
+  return events.size();
+}
+
+template <typename F> static void time_startup(const char *name, F load) {
+  auto start = std::chrono::steady_clock::now();
+  size_t events = load();
+  auto end = std::chrono::steady_clock::now();
+  printf("{\"benchmark\": \"%s\", \"events\": %zu, \"ms\": %.1f}\n", name,
+         events,
+         std::chrono::duration<double, std::milli>(end - start).count());
+  fflush(stdout);
+}
+
+// Loading of 1M and 10M event catalogs, using the page cache as a restart
+// would: the file is read once before it is timed.
+static void bench_startup() {
+  for (int count : {1000000, 10000000}) {
+    write_generated_events_file(BENCH_EVENTS_FILE, count);
+    load_serially(BENCH_EVENTS_FILE);
+    string suffix = std::to_string(count);
+    time_startup(("startup_serial_" + suffix).c_str(),
+                 [] { return load_serially(BENCH_EVENTS_FILE); });
+    time_startup(("startup_parallel_" + suffix).c_str(), [] {
+      EventCatalog catalog;
+      catalog.load(BENCH_EVENTS_FILE);
+      return catalog.size();
+    });
+    unlink(BENCH_EVENTS_FILE);
+  }
+}
+
+// Puts a GET_RESERVATION for one ticket into the buffer and handles it.
+static void request_reservation(Buffer &buffer, Data &data, uint32_t event,
+                                time_t now) {
+  get_reservation_message::encode(buffer.get(), event, 1);
+  buffer.try_to_insert_reservation(data, now, DEFAULT_TIMEOUT);
+  ENSURE(buffer.get_reply()[0] == (char)RESERVATION);
+}
+
+// Reservations committed to the journal every batch_size requests, as a
+// worker with -b batch_size does under load, against no journal at all.
+static void bench_journal() {
+  write_events_file(SOAK_EVENTS, UINT16_MAX);
+  char program[] = "ticket_server_bench";
+  char file_flag[] = "-f";
+  char events_path[] = BENCH_EVENTS_FILE;
+  char journal_flag[] = "-j";
+  char journal_path[] = JOURNAL_FILE;
+  char *argv[] = {program, file_flag, events_path, journal_flag, journal_path};
+  time_t now = time(nullptr);
+
+  for (int batch_size : {0, 1, 32, 256}) {
+    unlink(JOURNAL_FILE);
+    optind = 1;
+    ServerParameters parameters(batch_size == 0 ? 3 : 5, argv);
+    Data data(parameters);
+    Buffer buffer;
+    size_t requests = JOURNAL_BATCHES * std::max(batch_size, 256);
+    string name = batch_size == 0 ? "journal_off"
+                                  : "journal_batch_" + std::to_string(batch_size);
+    run_benchmark(name.c_str(), requests, [&](size_t i) {
+      request_reservation(buffer, data, (uint32_t)(i % SOAK_EVENTS), now);
+      if (batch_size > 0 && (i + 1) % batch_size == 0) {
+        data.commit_journal();
+      }
+    });
+  }
+  unlink(JOURNAL_FILE);
+  unlink(BENCH_EVENTS_FILE);
+}
+
+static size_t resident_kilobytes() {
+  size_t total_pages = 0;
+  size_t resident_pages = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  ENSURE(statm != nullptr);
+  ENSURE(fscanf(statm, "%zu %zu", &total_pages, &resident_pages) == 2);
+  fclose(statm);
+  return resident_pages * (size_t)sysconf(_SC_PAGESIZE) / 1024;
+}
+
+// Reserves and collects one ticket SOAK_RESERVATIONS times through the
+// request handlers and samples the resident set; with the archive it should
+// stay flat instead of growing with every achieved reservation.
+static void bench_archive_soak() {
+  write_events_file(SOAK_EVENTS, UINT16_MAX);
+  char program[] = "ticket_server_bench";
+  char file_flag[] = "-f";
+  char events_path[] = BENCH_EVENTS_FILE;
+  char archive_flag[] = "-a";
+  char archive_path[] = SOAK_ARCHIVE_FILE;
+  char *argv[] = {program, file_flag, events_path, archive_flag, archive_path};
+  optind = 1;
+  ServerParameters parameters(5, argv);
+  Data data(parameters);
+  Buffer buffer;
+  time_t now = time(nullptr);
+
+  for (size_t i = 1; i <= SOAK_RESERVATIONS; i++) {
+    request_reservation(buffer, data, (uint32_t)(i % SOAK_EVENTS), now);
+
+    // The reply is in the same buffer as the next request
+    char cookie[COOKIE_SIZE];
+    memcpy(cookie, reservation_message::get<3>(buffer.get_reply()),
+           COOKIE_SIZE);
+    get_tickets_message::encode(
+        buffer.get(), reservation_message::get<0>(buffer.get_reply()), cookie);
+    buffer.try_to_insert_tickets(data, now);
+    ENSURE(buffer.get_reply()[0] == (char)TICKETS);
+
+    if (i % SOAK_SAMPLE_EVERY == 0) {
+      printf("{\"benchmark\": \"archive_soak\", \"reservations\": %zu, "
+             "\"rss_kb\": %zu}\n",
+             i, resident_kilobytes());
+      fflush(stdout);
+    }
+  }
+  unlink(BENCH_EVENTS_FILE);
+  unlink(SOAK_ARCHIVE_FILE);
+}
+
+// The encoders and decoders the wire format schema replaced, kept as the
+// baselines: the runtime switch on sizeof of this server and the base 256
+// arithmetic of the imperative one.
+template <typename T> static void switch_insert(char *buffer, size_t &index,
+                                                T number) {
+  switch (sizeof(T)) {
+  case 1:
+    break;
+  case 2:
+    number = htobe16(number);
+    break;
+  case 4:
+    number = htobe32(number);
+    break;
+  default:
+    number = htobe64(number);
+  }
+  memcpy(buffer + index, &number, sizeof(T));
+  index += sizeof(T);
+}
+
+template <typename T> static T switch_receive(const char *buffer,
+                                              size_t &index) {
+  T number;
+  memcpy(&number, buffer + index, sizeof(T));
+  index += sizeof(T);
+  switch (sizeof(T)) {
+  case 1:
+    return number;
+  case 2:
+    return be16toh(number);
+  case 4:
+    return be32toh(number);
+  default:
+    return be64toh(number);
+  }
+}
+
+template <typename T> static void base256_insert(char *buffer, int *index,
+                                                 T number) {
+  int octet_size = sizeof(T);
+  std::vector<size_t> result(octet_size, 0);
+  for (int i = octet_size - 1; i >= 0; i--) {
+    result[i] = number % 256;
+    number = number >> 8;
+  }
+  for (int i = 0; i < octet_size; i++) {
+    buffer[*index + i] = (char)result[i];
+  }
+  *index += octet_size;
+}
+
+static int base256_receive(const char *buffer, int size, int *index) {
+  std::vector<int> arr(size);
+  int result = 0;
+  for (int i = 0; i < size; i++) {
+    arr[size - 1 - i] = (int)(unsigned char)buffer[*index + i];
+  }
+  for (int i = 0; i < size; i++) {
+    result += arr[i] * (int)pow(256, i);
+  }
+  *index += size;
+  return result;
+}
+
+static bool branches_validate(const char *message, size_t length) {
+  uint8_t message_id = message[0];
+  return ((message_id == 1) && (length == 1)) ||
+         ((message_id == 3) && (length == 7)) ||
+         ((message_id == 5) && (length == 53));
+}
+
+// Encoding of RESERVATION, decoding of GET_RESERVATION and validation of
+// request lengths, each with the old code and with the schema.
+static void bench_protocol() {
+  char buffer[BUFFER_SIZE];
+  char cookie[COOKIE_SIZE];
+  reservation::generate_cookie(cookie);
+
+  run_benchmark("protocol_encode_reservation_switch", 10000000, [&](size_t i) {
+    size_t index = 0;
+    switch_insert(buffer, index, RESERVATION);
+    switch_insert(buffer, index, (uint32_t)(FIRST_RESERVATION_ID + i));
+    switch_insert(buffer, index, (uint32_t)i);
+    switch_insert(buffer, index, (uint16_t)i);
+    memcpy(buffer + index, cookie, COOKIE_SIZE);
+    index += COOKIE_SIZE;
+    switch_insert(buffer, index, (uint64_t)BENCH_EXPIRATION_TIME);
+    sink = buffer[index - 1];
+  });
+  run_benchmark("protocol_encode_reservation_base256", 1000000, [&](size_t i) {
+    int index = 0;
+    base256_insert(buffer, &index, RESERVATION);
+    base256_insert(buffer, &index, (uint32_t)(FIRST_RESERVATION_ID + i));
+    base256_insert(buffer, &index, (uint32_t)i);
+    base256_insert(buffer, &index, (uint16_t)i);
+    memcpy(buffer + index, cookie, COOKIE_SIZE);
+    index += COOKIE_SIZE;
+    base256_insert(buffer, &index, (uint64_t)BENCH_EXPIRATION_TIME);
+    sink = buffer[index - 1];
+  });
+  run_benchmark("protocol_encode_reservation_schema", 10000000, [&](size_t i) {
+    size_t length = reservation_message::encode(
+        buffer, (uint32_t)(FIRST_RESERVATION_ID + i), (uint32_t)i,
+        (uint16_t)i, cookie, (uint64_t)BENCH_EXPIRATION_TIME);
+    sink = buffer[length - 1];
+  });
+
+  std::vector<std::array<char, 8>> requests(1 << 10);
+  for (size_t i = 0; i < requests.size(); i++) {
+    get_reservation_message::encode(requests[i].data(), (uint32_t)(i * 7919),
+                                    (uint16_t)i);
+  }
+  run_benchmark("protocol_decode_get_reservation_switch", 10000000,
+                [&](size_t i) {
+                  const char *request = requests[i & 1023].data();
+                  size_t index = 1;
+                  uint32_t event_id = switch_receive<uint32_t>(request, index);
+                  uint16_t count = switch_receive<uint16_t>(request, index);
+                  sink = (char)(event_id + count);
+                });
+  run_benchmark("protocol_decode_get_reservation_base256", 1000000,
+                [&](size_t i) {
+                  const char *request = requests[i & 1023].data();
+                  int index = 1;
+                  int event_id = base256_receive(request, 4, &index);
+                  int count = base256_receive(request, 2, &index);
+                  sink = (char)(event_id + count);
+                });
+  run_benchmark("protocol_decode_get_reservation_schema", 10000000,
+                [&](size_t i) {
+                  const char *request = requests[i & 1023].data();
+                  uint32_t event_id = get_reservation_message::get<0>(request);
+                  uint16_t count = get_reservation_message::get<1>(request);
+                  sink = (char)(event_id + count);
+                });
+
+  // Valid and invalid requests mixed, as a server exposed to anyone sees
+  std::vector<std::pair<char, size_t>> datagrams(1 << 10);
+  uint32_t state = 12345;
+  for (auto &datagram : datagrams) {
+    state = state * 1103515245 + 12345;
+    datagram = {(char)((state >> 16) % 8), (size_t)((state >> 8) % 60)};
+  }
+  run_benchmark("protocol_validate_branches", 10000000, [&](size_t i) {
+    auto &datagram = datagrams[i & 1023];
+    sink = (char)branches_validate(&datagram.first, datagram.second);
+  });
+  run_benchmark("protocol_validate_schema", 10000000, [&](size_t i) {
+    auto &datagram = datagrams[i & 1023];
+    sink = (char)is_valid_request(&datagram.first, datagram.second);
+  });
+}
+
+// The per ticket loop the ticket kernels replaced, kept as the baseline.
+static void write_ticket_by_division(size_t ticket_id, char *destination) {
+  size_t charset_size = strlen(ticket_charset);
+  for (int i = TICKET_OCTETS - 1; i >= 0; i--) {
+    destination[i] = (ticket_charset[ticket_id % charset_size]);
+    ticket_id /= (int)charset_size;
+  }
+}
+
+// The per byte cookie mapping that map_cookie_block replaced.
+static size_t map_cookie_bytes_by_branch(const uint8_t *bytes, size_t count,
+                                         char *cookie, size_t filled) {
+  for (size_t i = 0; i < count && filled < COOKIE_SIZE; i++) {
+    if (bytes[i] < COOKIE_BYTE_LIMIT) {
+      cookie[filled++] =
+          (char)(MIN_COOKIE_CHAR + bytes[i] % COOKIE_CHARSET_SIZE);
+    }
+  }
+  return filled;
+}
+
+// The codes of a 9000 ticket reservation, written on their own and as the
+// whole TICKETS reply to a GET_TICKETS, and the mapping of random bytes to
+// cookie characters, without the getrandom calls that feed it.
+static void bench_tickets() {
+  char tickets[LARGE_RESERVATION_TICKETS * TICKET_OCTETS];
+  size_t first_ticket_id = 123456789;
+  run_benchmark("tickets_9000_division", 10000, [&](size_t i) {
+    for (size_t n = 0; n < LARGE_RESERVATION_TICKETS; n++) {
+      write_ticket_by_division(first_ticket_id + i + n,
+                               tickets + n * TICKET_OCTETS);
+    }
+    sink = tickets[i % sizeof(tickets)];
+  });
+  run_benchmark("tickets_9000_kernel", 10000, [&](size_t i) {
+    reservation::write_tickets(first_ticket_id + i, LARGE_RESERVATION_TICKETS,
+                               tickets);
+    sink = tickets[i % sizeof(tickets)];
+  });
+
+  write_events_file(1, UINT16_MAX);
+  char program[] = "ticket_server_bench";
+  char file_flag[] = "-f";
+  char events_path[] = BENCH_EVENTS_FILE;
+  char *argv[] = {program, file_flag, events_path};
+  optind = 1;
+  ServerParameters parameters(3, argv);
+  Data data(parameters);
+  Buffer buffer;
+  time_t now = time(nullptr);
+  get_reservation_message::encode(buffer.get(), 0, LARGE_RESERVATION_TICKETS);
+  buffer.try_to_insert_reservation(data, now, DEFAULT_TIMEOUT);
+  ENSURE(buffer.get_reply()[0] == (char)RESERVATION);
+  char request[get_tickets_message::length];
+  get_tickets_message::encode(request,
+                              reservation_message::get<0>(buffer.get_reply()),
+                              reservation_message::get<3>(buffer.get_reply()));
+  run_benchmark("tickets_9000_reply", 10000, [&](size_t) {
+    memcpy(buffer.get(), request, sizeof(request));
+    buffer.try_to_insert_tickets(data, now);
+    sink = buffer.get_reply()[buffer.get_size() - 1];
+  });
+  unlink(BENCH_EVENTS_FILE);
+
+  // More bytes than the branch predictor could learn
+  std::vector<uint8_t> entropy(COOKIE_MAP_BYTES);
+  uint32_t state = 12345;
+  for (uint8_t &byte : entropy) {
+    state = state * 1103515245 + 12345;
+    byte = (uint8_t)(state >> 24);
+  }
+  // A cookie uses about 66 bytes, so each one starts 80 bytes further
+  run_benchmark("cookie_map_branch", 1000000, [&](size_t i) {
+    const uint8_t *bytes = entropy.data() + (i % COOKIE_MAP_COOKIES) * 80;
+    char cookie[COOKIE_SIZE];
+    size_t filled = 0;
+    for (size_t offset = 0; filled < COOKIE_SIZE; offset += COOKIE_MAP_BLOCK) {
+      filled = map_cookie_bytes_by_branch(bytes + offset, COOKIE_MAP_BLOCK,
+                                          cookie, filled);
+    }
+    sink = cookie[COOKIE_SIZE - 1];
+  });
+  run_benchmark("cookie_map_kernel", 1000000, [&](size_t i) {
+    const uint8_t *bytes = entropy.data() + (i % COOKIE_MAP_COOKIES) * 80;
+    char cookie[COOKIE_SIZE + COOKIE_MAP_BLOCK];
+    size_t filled = 0;
+    for (size_t offset = 0; filled < COOKIE_SIZE; offset += COOKIE_MAP_BLOCK) {
+      filled = map_cookie_block(bytes + offset, cookie, filled);
+    }
+    sink = cookie[COOKIE_SIZE - 1];
+  });
+}
+
+// State of the ticket server on a catalog of `events` events; Data keeps
+// a reference to its parameters, so both are owned together.
+struct core_server {
+  std::unique_ptr<ServerParameters> parameters;
+  std::unique_ptr<Data> data;
+};
+
+static core_server make_core_server(int events) {
+  write_events_file(events, CORE_EVENT_TICKETS);
+  static char program[] = "ticket_server_bench";
+  static char file_flag[] = "-f";
+  static char events_path[] = BENCH_EVENTS_FILE;
+  char *argv[] = {program, file_flag, events_path};
+  optind = 1;
+  core_server server;
+  server.parameters = std::make_unique<ServerParameters>(3, argv);
+  server.data = std::make_unique<Data>(*server.parameters);
+  unlink(BENCH_EVENTS_FILE);
+  return server;
+}
+
+static void core_imperative_events(int events,
+                                   imperative::eventMap &events_map) {
+  write_events_file(events, CORE_EVENT_TICKETS);
+  char events_path[] = BENCH_EVENTS_FILE;
+  imperative::parse_from_file(events_path, events_map);
+  unlink(BENCH_EVENTS_FILE);
+}
+
+// GET_TICKETS for the reservation in a RESERVATION reply
+static void core_request_tickets(const char *reply, char *request) {
+  char cookie[COOKIE_SIZE];
+  memcpy(cookie, reservation_message::get<3>(reply), COOKIE_SIZE);
+  get_tickets_message::encode(request, reservation_message::get<0>(reply),
+                              cookie);
+}
+
+// The same core operations of both implementations, each on its own:
+// handlers of the three requests, the expiry of reservations and cookie
+// generation. Names end with the implementation that was measured.
+static void bench_core() {
+  time_t now = time(nullptr);
+
+  // Both cases end with every byte of the EVENTS reply in a buffer: the
+  // oop server may send its patched datagram in place, so it is copied
+  // out, while the imperative one serializes every event into its buffer
+  for (int events : {10, 1000, 100000}) {
+    string suffix = std::to_string(events);
+    core_server server = make_core_server(events);
+    Buffer buffer;
+    std::vector<char> reply(BUFFER_SIZE);
+    run_benchmark(("core_insert_events_" + suffix + "_oop").c_str(), 100000,
+                  [&](size_t) {
+                    get_events_message::encode(buffer.get());
+                    buffer.insert_events(*server.data, 0);
+                    memcpy(reply.data(), buffer.get_reply(),
+                           buffer.get_size());
+                    sink = reply[buffer.get_size() - 1];
+                  });
+
+    imperative::eventMap events_map;
+    core_imperative_events(events, events_map);
+    run_benchmark(("core_insert_events_" + suffix + "_imperative").c_str(),
+                  events > 1000 ? 2000 : 100000, [&](size_t) {
+                    int length;
+                    get_events_message::encode(imperative::shared_buffer);
+                    imperative::send_events(events_map, &length);
+                    sink = imperative::shared_buffer[length - 1];
+                  });
+  }
+
+  {
+    core_server server = make_core_server(1000);
+    Buffer buffer;
+    run_benchmark("core_insert_reservation_oop", CORE_LIVE_RESERVATIONS,
+                  [&](size_t i) {
+                    get_reservation_message::encode(buffer.get(),
+                                                    (uint32_t)(i % 1000), 1);
+                    buffer.try_to_insert_reservation(*server.data, now,
+                                                     DEFAULT_TIMEOUT);
+                    sink = buffer.get_reply()[0];
+                  });
+    // CORE_LIVE_RESERVATIONS reservations are live now, none expired
+    run_benchmark("core_remove_expired_none_1m_oop", 1000000, [&](size_t) {
+      server.data->remove_expired_reservations(now);
+    });
+    time_t later = now + DEFAULT_TIMEOUT + 1;
+    run_benchmark("core_remove_expired_all_1m_oop", 1, [&](size_t) {
+      server.data->remove_expired_reservations(later);
+    });
+
+    imperative::eventMap events_map;
+    imperative::reservationMap reservations_map;
+    core_imperative_events(1000, events_map);
+    run_benchmark("core_insert_reservation_imperative", CORE_LIVE_RESERVATIONS,
+                  [&](size_t i) {
+                    int length;
+                    get_reservation_message::encode(imperative::shared_buffer,
+                                                    (uint32_t)(i % 1000), 1);
+                    imperative::send_reservation_or_bad(
+                        now + DEFAULT_TIMEOUT, events_map, reservations_map,
+                        &length);
+                    sink = imperative::shared_buffer[0];
+                  });
+    run_benchmark("core_remove_expired_none_1m_imperative", 20, [&](size_t) {
+      imperative::remove_expired_reservations(events_map, reservations_map,
+                                              now);
+    });
+    run_benchmark("core_remove_expired_all_1m_imperative", 1, [&](size_t) {
+      imperative::remove_expired_reservations(events_map, reservations_map,
+                                              later);
+    });
+  }
+
+  // GET_TICKETS of an achieved reservation, which the server answers with
+  // its tickets every time it is asked
+  for (int tickets : {1, LARGE_RESERVATION_TICKETS}) {
+    string suffix = std::to_string(tickets);
+    size_t iterations = tickets == 1 ? 1000000 : 10000;
+    char request[get_tickets_message::length];
+
+    core_server server = make_core_server(1);
+    Buffer buffer;
+    get_reservation_message::encode(buffer.get(), 0, (uint16_t)tickets);
+    buffer.try_to_insert_reservation(*server.data, now, DEFAULT_TIMEOUT);
+    ENSURE(buffer.get_reply()[0] == (char)RESERVATION);
+    core_request_tickets(buffer.get_reply(), request);
+    run_benchmark(("core_insert_tickets_" + suffix + "_oop").c_str(),
+                  iterations, [&](size_t) {
+                    memcpy(buffer.get(), request, sizeof(request));
+                    buffer.try_to_insert_tickets(*server.data, now);
+                    sink = buffer.get_reply()[buffer.get_size() - 1];
+                  });
+
+    imperative::eventMap events_map;
+    imperative::reservationMap reservations_map;
+    core_imperative_events(1, events_map);
+    int length;
+    get_reservation_message::encode(imperative::shared_buffer, 0,
+                                    (uint16_t)tickets);
+    imperative::send_reservation_or_bad(now + DEFAULT_TIMEOUT, events_map,
+                                        reservations_map, &length);
+    ENSURE(imperative::shared_buffer[0] == (char)RESERVATION);
+    core_request_tickets(imperative::shared_buffer, request);
+    run_benchmark(("core_insert_tickets_" + suffix + "_imperative").c_str(),
+                  iterations, [&](size_t) {
+                    memcpy(imperative::shared_buffer, request, sizeof(request));
+                    imperative::send_tickets_or_bad(now, reservations_map,
+                                                    &length);
+                    sink = imperative::shared_buffer[length - 1];
+                  });
+  }
+
+  run_benchmark("core_generate_cookie_oop", 1000000, [](size_t) {
+    char cookie[COOKIE_SIZE];
+    reservation::generate_cookie(cookie);
+    sink = cookie[0];
+  });
+  run_benchmark("core_generate_cookie_imperative", 100000, [](size_t) {
+    sink = imperative::generate_cookie()[0];
+  });
+}
+
+static bool selected(int argc, char *argv[], const char *name) {
+  if (argc == 1) {
+    return true;
+  }
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], name) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char *argv[]) {
+  if (selected(argc, argv, "cookies")) {
+    bench_cookies();
+  }
+  if (selected(argc, argv, "catalog")) {
+    bench_catalog();
+  }
+  if (selected(argc, argv, "startup")) {
+    bench_startup();
+  }
+  if (selected(argc, argv, "journal")) {
+    bench_journal();
+  }
+  if (selected(argc, argv, "soak")) {
+    bench_archive_soak();
+  }
+  if (selected(argc, argv, "protocol")) {
+    bench_protocol();
+  }
+  if (selected(argc, argv, "tickets")) {
+    bench_tickets();
+  }
+  if (selected(argc, argv, "core")) {
+    bench_core();
+  }
+}
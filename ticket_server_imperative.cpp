@@ -9,14 +9,18 @@
 #include <cstdint>
 #include <cstring>
 #include <ctime>
-#include <cmath>
 #include <utility>
 #include <vector>
 #include <string>
 #include <map>
 
+#include "ticket_protocol.h"
+
 using std::string;
 using std::vector;
+
+struct event;
+struct reservation;
 using eventMap = std::map<int, struct event>;
 using reservationMap = std::map<int, struct reservation>;
 
@@ -29,34 +33,11 @@ using reservationMap = std::map<int, struct reservation>;
 #define DEFAULT_PORT 2022
 #define DEFAULT_TIMEOUT 5
 
-#define GET_EVENTS (uint8_t) 1
-#define EVENTS (uint8_t) 2
-#define GET_RESERVATION (uint8_t) 3
-#define RESERVATION (uint8_t) 4
-#define GET_TICKETS (uint8_t) 5
-#define TICKETS (uint8_t) 6
-#define BAD_REQUEST (uint8_t) 255
-
-#define TWO_OCT 2
-#define FOUR_OCT 4
-
 #define MIN_COOKIE_CHAR 33
 #define MAX_COOKIE_CHAR 126
 
-#define COOKIE_POS 5
-#define CONST_OCTETS 7
-#define TICKET_OCTETS 7
 #define MAX_DESCRIPTION_SIZE 80
-#define COOKIE_SIZE 48
-#define COUNTING_BASE 256
 
-#define GET_EVENTS_MSG_LENGTH 1
-#define GET_RESERVATION_MSG_LENGTH 7
-#define GET_TICKETS_MSG_LENGTH 53
-#define RESERVATION_MSG_LENGTH 67
-#define BAD_REQUEST_MSG_LENGTH 5
-
-#define BUFFER_SIZE 65507
 char shared_buffer[BUFFER_SIZE];
 static char ticket_charset[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 int ticket_current_id = 0;
@@ -249,28 +230,6 @@ int new_ticket_id() {
 	return ticket_current_id++;
 }
 
-int parse_number_from_buffer(int size, int *index) {
-	int arr[size];
-	int result = 0;
-
-	for (int i = 0; i < size; i++) {
-		arr[size - 1 - i] = (int) (unsigned char) shared_buffer[*index + i];
-	}
-	for (int i = 0; i < size; i++) {
-		result += arr[i] * (int) pow(COUNTING_BASE, i);
-	}
-	*index += size;
-	return result;
-}
-
-char *parse_cookie_from_buffer() {
-	static char cookie[COOKIE_SIZE];
-	for (int i = 0; i < COOKIE_SIZE; i++) {
-		cookie[i] = shared_buffer[i + COOKIE_POS];
-	}
-	return cookie;
-}
-
 bool check_reservation(int event_id, int ticket_count, eventMap &events_map,
                        reservationMap &reservations_map) {
 
@@ -283,7 +242,7 @@ bool check_reservation(int event_id, int ticket_count, eventMap &events_map,
 	if (events_map.at(event_id).tickets_available < ticket_count) {
 		return false;
 	}
-	if ((TICKET_OCTETS + ticket_count * TICKET_OCTETS) > BUFFER_SIZE) {
+	if ((size_t) ticket_count > tickets_message::max_tickets) {
 		return false;//sytuacja przepełnienia bufora
 	}
 
@@ -305,7 +264,7 @@ string generate_cookie() {
 string generate_ticket() {
 	int ticket_id = new_ticket_id();
 	string ticket(TICKET_OCTETS, 'A');
-	size_t charset_size = strlen(ticket_charset);
+	size_t charset_size = sizeof(ticket_charset) - 1;
 
 	for (int i = TICKET_OCTETS - 1; i >= 0; i--) {
 		ticket[i] = (ticket_charset[ticket_id % charset_size]);
@@ -314,67 +273,29 @@ string generate_ticket() {
 	return ticket;
 }
 
-template<typename T>
-void move_to_buff(vector<T> vec, int *index) {
-	size_t size = vec.size();
-	for (int i = 0; i < size; i++) {
-		shared_buffer[*index + i] = (char) vec[i];
-	}
-	*index += (int) size;
-}
-
-template<typename T>
-void move_to_buff(T number, int *index) {
-	int octet_size = sizeof(T);
-	vector<size_t> result(octet_size, 0);
-	for (int i = octet_size - 1; i >= 0; i--) {
-		result[i] = number % COUNTING_BASE;
-		number = number >> 8;
-	}
-	move_to_buff(result, index);
-}
-
-void move_to_buff(string s, int *index) {
-	size_t length = s.length();
-	for (int i = 0; i < length; i++) {
-		shared_buffer[*index + i] = (char) s[i];
-	}
-	*index += (int) length;
-}
-
 void insert_event_to_buffer(event &e, int event_id, int *index) {
-
-	move_to_buff(event_id, index);
-	move_to_buff(e.tickets_available, index);
-	move_to_buff(e.description_length, index);
-	move_to_buff(e.description, index);
+	*index += (int) event_entry::encode(shared_buffer + *index,
+	                                    event_id, e.tickets_available,
+	                                    e.description.data(),
+	                                    e.description_length);
 }
 
-void insert_reservation_to_buffer(int reservation_id, reservation &r) {
-	int index = 0;
-
-	move_to_buff(RESERVATION, &index);
-	move_to_buff(reservation_id, &index);
-	move_to_buff(r.event_id, &index);
-	move_to_buff(r.ticket_count, &index);
-	move_to_buff(r.cookie, &index);
-	move_to_buff(r.expiration_time, &index);
+size_t insert_reservation_to_buffer(int reservation_id, reservation &r) {
+	return reservation_message::encode(shared_buffer, reservation_id,
+	                                   r.event_id, r.ticket_count,
+	                                   r.cookie.data(), r.expiration_time);
 }
 
-void insert_bad_request_to_buffer(int id) {
-	int index = 0;
-
-	move_to_buff(BAD_REQUEST, &index);
-	move_to_buff(id, &index);
+size_t insert_bad_request_to_buffer(int id) {
+	return bad_request_message::encode(shared_buffer, id);
 }
 
 void send_reservation_or_bad(time_t expiration_time, eventMap &events_map,
                              reservationMap &reservations_map,
                              int *message_length) {
 
-	int index = 1;
-	int event_id = parse_number_from_buffer(FOUR_OCT, &index);
-	int ticket_count = parse_number_from_buffer(TWO_OCT, &index);
+	int event_id = (int) get_reservation_message::get<0>(shared_buffer);
+	int ticket_count = get_reservation_message::get<1>(shared_buffer);
 
 	if (check_reservation(event_id, ticket_count, events_map,
 	                      reservations_map)) {
@@ -386,24 +307,22 @@ void send_reservation_or_bad(time_t expiration_time, eventMap &events_map,
 
 		reservations_map.insert({reservation_id, new_reservation});
 		events_map.at(event_id).tickets_available -= ticket_count;
-		insert_reservation_to_buffer(reservation_id, new_reservation);
-		*message_length = RESERVATION_MSG_LENGTH;
+		*message_length = (int) insert_reservation_to_buffer(reservation_id,
+		                                                     new_reservation);
 
 	} else {
-		insert_bad_request_to_buffer(event_id);
-		*message_length = BAD_REQUEST_MSG_LENGTH;
+		*message_length = (int) insert_bad_request_to_buffer(event_id);
 	}
 }
 
 
 void send_events(eventMap &events_map, int *message_length) {
-	int index = 0;
-	move_to_buff(EVENTS, &index);
+	int index = (int) events_message::encode(shared_buffer);
 
 	for (auto &element: events_map) {
 		int event_id = element.first;
 		event &eve = element.second;
-		int eve_size = eve.description_length + CONST_OCTETS;
+		int eve_size = (int) event_entry::length_with(eve.description_length);
 
 		if (index + eve_size > BUFFER_SIZE) {
 			break;
@@ -415,12 +334,12 @@ void send_events(eventMap &events_map, int *message_length) {
 }
 
 void fill_buffer_tickets(int reservation_id, const reservation &r, int *index) {
-	move_to_buff(TICKETS, index);
-	move_to_buff(reservation_id, index);
-	move_to_buff(r.ticket_count, index);
-	for (const string &ticket: r.tickets) {
-		move_to_buff(ticket, index);
+	tickets_message::encode(shared_buffer, reservation_id, r.ticket_count);
+	for (size_t i = 0; i < r.tickets.size(); i++) {
+		memcpy(tickets_message::ticket(shared_buffer, i), r.tickets[i].data(),
+		       TICKET_OCTETS);
 	}
+	*index = (int) tickets_message::length_with(r.ticket_count);
 }
 
 bool check_tickets(int reservation_id, string &cookie, time_t current_time,
@@ -437,9 +356,8 @@ bool check_tickets(int reservation_id, string &cookie, time_t current_time,
 
 void send_tickets_or_bad(time_t current_time, reservationMap &reservations_map,
                          int *message_length) {
-	int index = 1;
-	int reservation_id = parse_number_from_buffer(FOUR_OCT, &index);
-	string cookie = parse_cookie_from_buffer();
+	int reservation_id = (int) get_tickets_message::get<0>(shared_buffer);
+	string cookie(get_tickets_message::get<1>(shared_buffer), COOKIE_SIZE);
 	if (check_tickets(reservation_id, cookie, current_time, reservations_map)) {
 		reservation &r = reservations_map.at(reservation_id);
 		if (!r.achieved) {
@@ -452,8 +370,7 @@ void send_tickets_or_bad(time_t current_time, reservationMap &reservations_map,
 		fill_buffer_tickets(reservation_id, r, message_length);
 
 	} else {
-		insert_bad_request_to_buffer(reservation_id);
-		*message_length = BAD_REQUEST_MSG_LENGTH;
+		*message_length = (int) insert_bad_request_to_buffer(reservation_id);
 	}
 }
 
@@ -496,17 +413,6 @@ void remove_expired_reservations(eventMap &events_map,
 	}
 }
 
-bool check_if_message_valid(size_t read_length) {
-	int message_id = (int) (unsigned char) shared_buffer[0];
-	if ((message_id == 1) && (read_length == GET_EVENTS_MSG_LENGTH))
-		return true;
-	if ((message_id == 3) && (read_length == GET_RESERVATION_MSG_LENGTH))
-		return true;
-	if ((message_id == 5) && (read_length == GET_TICKETS_MSG_LENGTH))
-		return true;
-	return false;
-}
-
 void execute_command_send_message(int socket_fd,
                                   const struct sockaddr_in *client_address,
                                   eventMap &events_map,
@@ -546,6 +452,8 @@ void execute_command_send_message(int socket_fd,
 }
 
 
+// The benchmarks include this file with TICKET_SERVER_NO_MAIN defined
+#ifndef TICKET_SERVER_NO_MAIN
 int main(int argc, char *argv[]) {
 
 	int port = DEFAULT_PORT;
@@ -583,7 +491,7 @@ int main(int argc, char *argv[]) {
 		current_time = time(nullptr);
 		remove_expired_reservations(events_map, reservations_map, current_time);
 
-		is_valid = check_if_message_valid(read_length);
+		is_valid = is_valid_request(shared_buffer, read_length);
 		if (is_valid) {
 			execute_command_send_message(socket_fd, &client_address,
 			                             events_map, reservations_map,
@@ -595,4 +503,5 @@ int main(int argc, char *argv[]) {
 		}
 
 	} while (read_length > 0);
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file